@@ -0,0 +1,811 @@
+// Approximate contexts, found by a lexical scan of the source text - without libclang, i.e. without preprocessing or parsing.
+// Much faster than parsing, but macros, conditional compilation (both branches of an #if are scanned) and unusual declarations can give wrong answers. Contexts are in the same format as scope_name() output.
+
+#pragma once
+
+#include <algorithm> // search
+#include <cctype> // isalnum, isdigit, isspace
+#include <cstring> // memchr, strlen
+#include <initializer_list>
+#include <string>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+const char* const approximate_context_label = "(approximate)\n"; // (Output as the last line of each approximate context.)
+
+
+namespace LexicalScan
+{
+    inline bool is_identifier_character(char c)
+    {
+        return isalnum(static_cast<unsigned char>(c)) or c == '_';
+    }
+
+    inline bool is_one_of(const std::string& s, std::initializer_list<const char*> strings)
+    {
+        for (const auto string : strings)
+        {
+            if (s == string) { return true; }
+        }
+        return false;
+    }
+
+
+    // Returns the first character in [p, end) that the scan has to stop at - one of { } ( ) ; / " ' # - or end.
+    // (Sixteen characters are checked at a time where SSE2 is available.)
+    const char* find_special_character(const char* p, const char* const end)
+    {
+#ifdef __SSE2__
+        const __m128i special_characters[] = {_mm_set1_epi8('{'), _mm_set1_epi8('}'), _mm_set1_epi8('('), _mm_set1_epi8(')'), _mm_set1_epi8(';'),
+                                              _mm_set1_epi8('/'), _mm_set1_epi8('"'), _mm_set1_epi8('\''), _mm_set1_epi8('#')};
+        for (; end - p >= 16; p += 16)
+        {
+            const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            __m128i matches = _mm_setzero_si128();
+            for (const auto& special_character : special_characters)
+            {
+                matches = _mm_or_si128(matches, _mm_cmpeq_epi8(chunk, special_character));
+            }
+            if (const int mask = _mm_movemask_epi8(matches))
+            {
+                return p + __builtin_ctz(mask);
+            }
+        }
+#endif
+        for (; p != end; ++p)
+        {
+            switch (*p)
+            {
+                case '{': case '}': case '(': case ')': case ';': case '/': case '"': case '\'': case '#':
+                    return p;
+            }
+        }
+        return end;
+    }
+
+
+    // p points at "//" or "/*". Returns the end of the comment (the newline, for a "//" comment).
+    const char* skip_comment(const char* p, const char* const end)
+    {
+        if (p[1] == '/')
+        {
+            for (p += 2; p != end; ++p)
+            {
+                p = static_cast<const char*>(memchr(p, '\n', end - p));
+                if (not p) { return end; }
+                if (p[-1] != '\\') { return p; } // (A backslash continues the comment on the next line.)
+            }
+            return end;
+        }
+        for (p += 2; p < end; ++p)
+        {
+            p = static_cast<const char*>(memchr(p, '*', end - p));
+            if (not p) { return end; }
+            if (p + 1 != end and p[1] == '/') { return p + 2; }
+        }
+        return end;
+    }
+
+
+    // p points at the opening quote of a string or character literal. Returns the position after the closing quote (or of the end of the line, if the literal isn't terminated).
+    const char* skip_quoted(const char* p, const char* const end)
+    {
+        const char quote = *p;
+        for (++p; p != end; ++p)
+        {
+            if (*p == '\\')
+            {
+                if (++p == end) { break; }
+            }
+            else if (*p == quote)
+            {
+                return p + 1;
+            }
+            else if (*p == '\n')
+            {
+                return p;
+            }
+        }
+        return end;
+    }
+
+
+    // Whether the quote at p is preceded by a raw string literal prefix (R, LR, uR, UR or u8R).
+    bool is_raw_string(const char* const begin, const char* const p)
+    {
+        const char* q = p;
+        while (q != begin and is_identifier_character(q[-1])) { --q; }
+        const std::string prefix(q, p);
+        return is_one_of(prefix, {"R", "LR", "uR", "UR", "u8R"});
+    }
+
+
+    // p points at the opening quote of a raw string literal. Returns the position after its closing quote.
+    const char* skip_raw_string(const char* const p, const char* const end)
+    {
+        const char* const delimiter = p + 1;
+        const char* open_parenthesis = delimiter;
+        while (open_parenthesis != end and *open_parenthesis != '(' and open_parenthesis - delimiter <= 16) { ++open_parenthesis; }
+        if (open_parenthesis == end or *open_parenthesis != '(') // (Not a valid raw string literal.)
+        {
+            return skip_quoted(p, end);
+        }
+
+        const std::string terminator = ')' + std::string(delimiter, open_parenthesis) + '"';
+        const char* const found = std::search(open_parenthesis + 1, end, terminator.begin(), terminator.end());
+        return found == end ? end : found + terminator.length();
+    }
+
+
+    // Whether the single quote at p is a digit separator (as in 1'000'000) rather than the start of a character literal.
+    bool is_digit_separator(const char* const begin, const char* const p)
+    {
+        const char* q = p;
+        while (q != begin and (is_identifier_character(q[-1]) or q[-1] == '\'')) { --q; }
+        return q != p and isdigit(static_cast<unsigned char>(*q));
+    }
+
+
+    bool is_at_start_of_line(const char* const begin, const char* p)
+    {
+        while (p != begin and (p[-1] == ' ' or p[-1] == '\t')) { --p; }
+        return p == begin or p[-1] == '\n';
+    }
+
+
+    // p points at the '#' of a preprocessor directive. Returns the position of the newline that ends the directive (or end).
+    const char* skip_preprocessor_line(const char* p, const char* const end)
+    {
+        for (++p; p != end; ++p)
+        {
+            if (*p == '\n')
+            {
+                if (p[-1] != '\\') { return p; }
+            }
+            else if (*p == '/' and p + 1 != end and (p[1] == '/' or p[1] == '*'))
+            {
+                p = skip_comment(p, end) - 1;
+            }
+            else if (*p == '"' or *p == '\'')
+            {
+                p = skip_quoted(p, end) - 1;
+            }
+        }
+        return end;
+    }
+
+
+    struct Token
+    {
+        std::string text; // (String and character literals are "\"\"" and "''".)
+        size_t offset;
+    };
+
+    // Returns the tokens of text[from, to), skipping comments and preprocessor lines.
+    std::vector<Token> tokenize(const char* const text, const size_t from, const size_t to)
+    {
+        std::vector<Token> tokens;
+        const char* const end = text + to;
+        for (const char* p = text + from; p < end; )
+        {
+            const char* const token_start = p;
+            if (*p == ' ' or *p == '\t' or *p == '\n' or *p == '\r' or *p == '\f' or *p == '\v' or *p == '\\')
+            {
+                ++p;
+                continue;
+            }
+            if (*p == '/' and p + 1 != end and (p[1] == '/' or p[1] == '*'))
+            {
+                p = skip_comment(p, end);
+                continue;
+            }
+            if (*p == '#' and is_at_start_of_line(text, p))
+            {
+                p = skip_preprocessor_line(p, end);
+                continue;
+            }
+
+            if (*p == '"' or (*p == '\'' and not is_digit_separator(text, p)))
+            {
+                p = (*p == '"' and is_raw_string(text, p)) ? skip_raw_string(p, end) : skip_quoted(p, end);
+                tokens.push_back({std::string(2, *token_start), size_t(token_start - text)});
+                continue;
+            }
+
+            if (is_identifier_character(*p))
+            {
+                const bool is_number = isdigit(static_cast<unsigned char>(*p));
+                while (p != end and (is_identifier_character(*p) or (is_number and (*p == '\'' or *p == '.')))) { ++p; }
+                if (p != end and (*p == '"' or *p == '\'') and not is_number) // (A literal with a prefix, e.g. L"s" or u8R"(s)".)
+                {
+                    continue;
+                }
+            }
+            else
+            {
+                static const char* multiple_character_punctuators[] = {"...", "::", "->", "&&"};
+                ++p;
+                for (const auto punctuator : multiple_character_punctuators)
+                {
+                    const size_t length = strlen(punctuator);
+                    if (size_t(end - token_start) >= length and std::string(token_start, length) == punctuator)
+                    {
+                        p = token_start + length;
+                        break;
+                    }
+                }
+            }
+            tokens.push_back({std::string(token_start, p), size_t(token_start - text)});
+        }
+        return tokens;
+    }
+
+
+    inline bool is_word(const std::string& token)
+    {
+        return not token.empty() and is_identifier_character(token[0]);
+    }
+
+    // Returns the index of the token that closes the bracket at tokens[i], or tokens.size() if there isn't one.
+    size_t find_closing_bracket(const std::vector<Token>& tokens, size_t i)
+    {
+        const std::string open = tokens[i].text;
+        const std::string close = open == "(" ? ")" : open == "[" ? "]" : open == "{" ? "}" : ">";
+        for (size_t depth = 0; i != tokens.size(); ++i)
+        {
+            if (tokens[i].text == open) { ++depth; }
+            else if (tokens[i].text == close and --depth == 0) { return i; }
+        }
+        return tokens.size();
+    }
+
+    // Returns the index of the token that opens the bracket closed by tokens[i] (or tokens.size() if there isn't one).
+    size_t find_opening_bracket(const std::vector<Token>& tokens, size_t i)
+    {
+        const std::string close = tokens[i].text;
+        const std::string open = close == ")" ? "(" : close == "]" ? "[" : close == "}" ? "{" : "<";
+        for (size_t depth = 0; ; --i)
+        {
+            if (tokens[i].text == close) { ++depth; }
+            else if (tokens[i].text == open and --depth == 0) { return i; }
+            if (i == 0) { return tokens.size(); }
+        }
+    }
+
+    // Whether tokens[i] is a '<' that opens a template argument (or parameter) list. (A '<' that follows a name is taken to do so.)
+    inline bool is_template_bracket(const std::vector<Token>& tokens, size_t i)
+    {
+        return tokens[i].text == "<" and i != 0 and (is_word(tokens[i-1].text) and tokens[i-1].text != "operator");
+    }
+
+
+    // Joins tokens (e.g. of a type), spaced as libclang's display names are, e.g. "const std::vector<int> &", "char **".
+    std::string format_tokens(std::vector<Token>::const_iterator begin, std::vector<Token>::const_iterator end)
+    {
+        std::string result;
+        for (auto it = begin; it != end; ++it)
+        {
+            const auto& token = it->text;
+            if (not result.empty())
+            {
+                const char previous = result.back();
+                if (((is_word(token) or token == "(") and (is_identifier_character(previous) or previous == ',' or previous == '>'))
+                    or ((token == "*" or token == "&" or token == "&&") and (is_identifier_character(previous) or previous == '>')))
+                {
+                    result += ' ';
+                }
+            }
+            result += token;
+        }
+        return result;
+    }
+
+
+    // Returns the parameter types of a function, e.g. "int, char **" for tokens "int argc, char* argv[]".
+    std::string format_parameter_types(const std::vector<Token>& tokens, size_t begin, const size_t end)
+    {
+        std::vector<std::vector<Token>> parameters {{}};
+        for (size_t depth = 0; begin != end; ++begin)
+        {
+            const auto& token = tokens[begin].text;
+            if (token == "(" or token == "[" or token == "{" or is_template_bracket(tokens, begin)) { ++depth; }
+            else if (token == ")" or token == "]" or token == "}" or (token == ">" and depth)) { --depth; }
+            else if (token == "," and depth == 0) { parameters.push_back({}); continue; }
+            parameters.back().push_back(tokens[begin]);
+        }
+
+        std::string result;
+        for (auto& parameter : parameters)
+        {
+            for (size_t i = 0, depth = 0; i != parameter.size(); ++i) // (Remove any default argument.)
+            {
+                const auto& token = parameter[i].text;
+                if (token == "(" or token == "[" or token == "{") { ++depth; }
+                else if (token == ")" or token == "]" or token == "}") { --depth; }
+                else if (token == "=" and depth == 0) { parameter.resize(i); break; }
+            }
+
+            bool is_array = false;
+            while (not parameter.empty() and parameter.back().text == "]")
+            {
+                const auto open = find_opening_bracket(parameter, parameter.size() - 1);
+                if (open == parameter.size()) { break; }
+                parameter.resize(open);
+                is_array = true;
+            }
+
+            if (parameter.size() >= 2 and is_word(parameter.back().text)
+                and not is_one_of(parameter.back().text, {"void", "bool", "char", "wchar_t", "char16_t", "char32_t", "short", "int", "long", "float", "double", "signed", "unsigned", "auto", "const", "volatile"})
+                and not is_one_of(parameter[parameter.size() - 2].text, {"::", "struct", "class", "enum", "union", "typename"})
+                and not (parameter.size() == 2 and is_one_of(parameter[0].text, {"const", "volatile"}))) // (e.g. "const T", but not "char *const p")
+            {
+                parameter.pop_back(); // (the parameter's name)
+            }
+            for (size_t i = 0; i + 3 < parameter.size(); ++i) // (The name of a function pointer parameter, e.g. fp in "int (*fp)(int)".)
+            {
+                if (parameter[i].text == "(" and parameter[i+1].text == "*" and is_word(parameter[i+2].text) and parameter[i+3].text == ")")
+                {
+                    parameter.erase(parameter.begin() + i+2);
+                }
+            }
+            if (is_array)
+            {
+                parameter.push_back({"*", 0});
+            }
+
+            if (parameters.size() == 1 and parameter.size() == 1 and parameter[0].text == "void")
+            {
+                return "";
+            }
+            result += (result.empty() ? "" : ", ") + format_tokens(parameter.begin(), parameter.end());
+        }
+        return result;
+    }
+
+
+    enum class ScopeKind { Namespace, Class, Function, Lambda, Other };
+
+    // A brace-delimited scope, and its "head": the text from the end of the previous statement to the opening brace.
+    struct Scope
+    {
+        size_t head_begin, head_end;
+        bool is_classified;
+        ScopeKind kind;
+        std::string name; // (as output by scope_name(), e.g. "namespace N\n"; empty for a scope that scope_name() doesn't name, e.g. an if statement's block)
+        std::string class_name; // (for ScopeKind::Class; used to recognize constructors)
+        size_t start; // (offset of the first token of the declaration, i.e. where libclang's extent for it would start)
+        bool is_in_function_body;
+        bool may_be_initializer; // (Braces that follow a name may be those of a braced initializer, e.g. "v{1, 2}", which doesn't end the statement it's in.)
+        size_t parenthesis_depth; // (The number of '('s in the head that aren't closed in it. Braces within parentheses, e.g. "f(std::vector<int> v = {1, 2})" or a lambda argument, are part of the statement they're in.)
+    };
+
+
+    // Sets kind, name, class_name and start for the declaration in text[from, to) (a scope's head if has_body, otherwise a statement that ends with a semicolon).
+    void classify(const char* const text, const size_t from, const size_t to, const bool has_body, const Scope* const parent /*null at file scope*/, Scope& result)
+    {
+        result.kind = ScopeKind::Other;
+        result.name.clear();
+        result.start = to;
+
+        auto tokens = tokenize(text, from, to);
+        if (tokens.size() >= 2 and is_one_of(tokens[0].text, {"public", "protected", "private"}) and tokens[1].text == ":")
+        {
+            tokens.erase(tokens.begin(), tokens.begin() + 2);
+        }
+        if (tokens.empty()) { return; }
+        result.start = tokens[0].offset;
+
+        if (has_body) // Lambda? (The last '[' that introduces a lambda that the brace can be the body of.)
+        {
+            for (size_t i = tokens.size(); i-- != 0; )
+            {
+                if (tokens[i].text != "[" or (i != 0 and (is_word(tokens[i-1].text) or is_one_of(tokens[i-1].text, {")", "]", ">"})) and tokens[i-1].text != "return"))
+                {
+                    continue;
+                }
+                size_t j = find_closing_bracket(tokens, i);
+                if (j == tokens.size()) { continue; }
+                ++j;
+                if (j != tokens.size() and tokens[j].text == "(")
+                {
+                    j = find_closing_bracket(tokens, j);
+                    if (j == tokens.size()) { continue; }
+                    ++j;
+                }
+                while (j != tokens.size() and is_one_of(tokens[j].text, {"mutable", "constexpr", "noexcept"})) { ++j; }
+                if (j == tokens.size() or tokens[j].text == "->")
+                {
+                    result.kind = ScopeKind::Lambda;
+                    result.name = "[]\n";
+                    result.start = tokens[i].offset;
+                    return;
+                }
+            }
+        }
+
+        const bool is_in_function_body = parent and parent->is_in_function_body;
+
+        size_t i = 0; // (first token after any template headers)
+        std::vector<std::string> template_parameters;
+        while (i + 1 < tokens.size() and tokens[i].text == "template" and tokens[i+1].text == "<")
+        {
+            const size_t close = find_closing_bracket(tokens, i+1);
+            if (close == tokens.size()) { return; }
+            bool is_default_argument = false;
+            for (size_t j = i+2, depth = 0; j != close; ++j) // (The name of each template parameter is its last word before a ',' or '='.)
+            {
+                const auto& token = tokens[j].text;
+                if (token == "(" or token == "[" or token == "{" or token == "<") { ++depth; }
+                else if (token == ")" or token == "]" or token == "}" or token == ">") { --depth; }
+                else if (depth == 0 and (token == "," or token == "=")) { is_default_argument = token == "="; }
+                else if (depth == 0 and not is_default_argument and is_word(token) and (j+1 == close or tokens[j+1].text == "," or tokens[j+1].text == "="))
+                {
+                    template_parameters.push_back(token);
+                }
+            }
+            i = close + 1;
+        }
+        while (i != tokens.size() and is_one_of(tokens[i].text, {"typedef", "export", "inline"}) and not (tokens[i].text == "inline" and i+1 != tokens.size() and tokens[i+1].text == "namespace")) { ++i; }
+        if (i == tokens.size()) { return; }
+
+        if (has_body and (tokens[i].text == "namespace" or (tokens[i].text == "inline" and i+1 != tokens.size() and tokens[i+1].text == "namespace")))
+        {
+            result.kind = ScopeKind::Namespace;
+            result.name = "namespace ";
+            for (size_t j = i + (tokens[i].text == "inline" ? 2 : 1); j != tokens.size(); ++j)
+            {
+                if (tokens[j].text == "::") { result.name += "\nnamespace "; } // (C++17 nested namespace definition, e.g. namespace A::B.)
+                else if (is_word(tokens[j].text)) { result.name += tokens[j].text; }
+            }
+            result.name += "\n";
+            return;
+        }
+
+        if (is_one_of(tokens[i].text, {"class", "struct", "union", "enum"}))
+        {
+            const std::string keyword = tokens[i].text;
+            size_t j = i + 1;
+            if (keyword == "enum" and j != tokens.size() and is_one_of(tokens[j].text, {"class", "struct"})) { ++j; }
+
+            std::string name, template_arguments;
+            for (; j != tokens.size() and tokens[j].text != ":"; ++j)
+            {
+                if (tokens[j].text == "(") // (Not the head of a class, e.g. "struct S* f()".)
+                {
+                    if (j == 0 or not is_one_of(tokens[j-1].text, {"alignas", "__attribute__", "__declspec"})) { return; }
+                    j = find_closing_bracket(tokens, j);
+                    if (j == tokens.size()) { return; }
+                }
+                else if (tokens[j].text == "=" or tokens[j].text == ",") // (A variable, e.g. "struct S s = ")
+                {
+                    return;
+                }
+                else if (tokens[j].text == "[")
+                {
+                    j = find_closing_bracket(tokens, j);
+                    if (j == tokens.size()) { return; }
+                }
+                else if (is_template_bracket(tokens, j))
+                {
+                    const size_t close = find_closing_bracket(tokens, j);
+                    if (close == tokens.size()) { return; }
+                    template_arguments = "<" + format_tokens(tokens.begin() + j+1, tokens.begin() + close) + ">";
+                    j = close;
+                }
+                else if (is_word(tokens[j].text) and not is_one_of(tokens[j].text, {"final", "alignas", "__attribute__", "__declspec"}))
+                {
+                    name = tokens[j].text; // (The last word, e.g. S in "struct EXPORT_MACRO S" or "struct A::S".)
+                    template_arguments.clear();
+                }
+            }
+            if (not has_body) { return; }
+
+            if (template_arguments.empty() and not template_parameters.empty())
+            {
+                template_arguments = "<";
+                for (const auto& parameter : template_parameters)
+                {
+                    template_arguments += (template_arguments.length() == 1 ? "" : ", ") + parameter;
+                }
+                template_arguments += ">";
+            }
+            result.kind = ScopeKind::Class;
+            result.class_name = name;
+            result.name = keyword + " " + name + (keyword == "enum" ? "" : template_arguments) + "\n";
+            return;
+        }
+
+        // Function? The first '(' (that isn't within brackets) is taken to start its parameters.
+        size_t parameters_open = tokens.size();
+        bool is_operator = false;
+        for (size_t j = i, depth = 0; j != tokens.size(); ++j)
+        {
+            const auto& token = tokens[j].text;
+            if (token == "operator") { is_operator = true; }
+            if (token == "(" and depth == 0) { parameters_open = j; break; }
+            if (token == "(" or token == "[" or token == "{" or is_template_bracket(tokens, j)) { ++depth; }
+            else if (token == ")" or token == "]" or token == "}" or (token == ">" and depth)) { --depth; }
+            else if (token == "=" and depth == 0 and not is_operator) { return; } // (e.g. a variable's initializer)
+        }
+        if (parameters_open == tokens.size() or parameters_open == 0) { return; }
+
+        size_t name_begin = parameters_open;
+        std::string name;
+        for (size_t j = i; j != parameters_open; ++j)
+        {
+            if (tokens[j].text == "operator") // (e.g. "operator==", "operator int", "operator()")
+            {
+                name_begin = j;
+                if (j + 1 == parameters_open and parameters_open + 2 < tokens.size() and tokens[parameters_open + 1].text == ")" and tokens[parameters_open + 2].text == "(")
+                {
+                    name = "operator()";
+                    parameters_open += 2;
+                }
+                else
+                {
+                    const auto symbol_or_type = format_tokens(tokens.begin() + j+1, tokens.begin() + parameters_open);
+                    name = "operator" + std::string(is_word(symbol_or_type) ? " " : "") + symbol_or_type;
+                }
+                break;
+            }
+        }
+        if (name.empty())
+        {
+            name_begin = parameters_open - 1;
+            if (not is_word(tokens[name_begin].text) or is_one_of(tokens[name_begin].text,
+                    {"if", "for", "while", "switch", "catch", "return", "sizeof", "alignof", "decltype", "alignas", "noexcept", "throw", "static_assert", "typeid",
+                     "new", "delete", "__attribute__", "__declspec", "void", "bool", "char", "short", "int", "long", "float", "double", "signed", "unsigned", "auto"}))
+            {
+                return;
+            }
+            name = tokens[name_begin].text;
+            if (name_begin != 0 and tokens[name_begin-1].text == "~")
+            {
+                name = "~" + name;
+                --name_begin;
+            }
+        }
+        while (name_begin >= 2 and tokens[name_begin-1].text == "::") // (qualifiers, e.g. "S<N>::" in "S<N>::doit")
+        {
+            size_t qualifier_begin = name_begin - 2;
+            if (tokens[qualifier_begin].text == ">")
+            {
+                qualifier_begin = find_opening_bracket(tokens, qualifier_begin);
+                if (qualifier_begin == tokens.size() or qualifier_begin == 0) { break; }
+                --qualifier_begin;
+            }
+            if (not is_word(tokens[qualifier_begin].text)) { break; }
+            name = format_tokens(tokens.begin() + qualifier_begin, tokens.begin() + name_begin) + name;
+            name_begin = qualifier_begin;
+        }
+        if (name_begin < i) { return; }
+
+        const size_t parameters_close = find_closing_bracket(tokens, parameters_open);
+        if (parameters_close == tokens.size()) { return; }
+
+        for (size_t j = parameters_close + 1; j != tokens.size(); ++j) // (Only specifiers may follow the parameters.)
+        {
+            const auto& token = tokens[j].text;
+            if (token == ":" and has_body) // (A constructor's member initializer list. If it doesn't end with ')' or '}' the brace is a member's braced initializer.)
+            {
+                if (not is_one_of(tokens.back().text, {")", "}"})) { return; }
+                break;
+            }
+            if (token == "->" or (token == "=" and not has_body and j+1 != tokens.size() and is_one_of(tokens[j+1].text, {"0", "default", "delete"})))
+            {
+                break;
+            }
+            if (token == "(" or token == "[")
+            {
+                j = find_closing_bracket(tokens, j);
+                if (j == tokens.size()) { return; }
+            }
+            else if (not (is_word(token) or token == "&" or token == "&&"))
+            {
+                return;
+            }
+        }
+
+        bool has_type = false, is_static = false;
+        for (size_t j = i; j != name_begin; ++j)
+        {
+            const auto& token = tokens[j].text;
+            if (is_one_of(token, {"=", ".", "->", "return", "new", "delete", "throw", "else", "case", "goto", "using", "typedef", ",", "(", ")", "{", "}", ";"}))
+            {
+                return;
+            }
+            if (token == "static") { is_static = true; }
+            else if (not is_one_of(token, {"inline", "virtual", "explicit", "friend", "extern", "constexpr"})) { has_type = true; }
+        }
+
+        const bool is_member = parent and parent->kind == ScopeKind::Class;
+        if (is_in_function_body
+            or not (has_type
+                    or name.find("::") != std::string::npos
+                    or name.compare(0, strlen("operator"), "operator") == 0
+                    or (is_member and (name == parent->class_name or name == "~" + parent->class_name))))
+        {
+            return;
+        }
+
+        result.kind = ScopeKind::Function;
+        result.name = std::string(is_static and is_member ? "static " : "") + name + "(" + format_parameter_types(tokens, parameters_open + 1, parameters_close) + ")\n";
+    }
+
+
+    class Scanner
+    {
+        const char* const text;
+        const size_t text_length;
+        const std::vector<size_t>& offsets;
+        std::vector<std::string>& contexts;
+        size_t answered_offset_count{0};
+        std::vector<Scope> scopes; // (enclosing the scan position, outermost first)
+
+        void classify_scope(Scope& scope, const Scope* parent /*null at file scope*/)
+        {
+            classify(text, scope.head_begin, scope.head_end, /*has_body*/ true, parent, scope);
+            if (scope.parenthesis_depth != 0 and scope.kind != ScopeKind::Lambda) // (e.g. a braced default argument, whose head is an incomplete function head)
+            {
+                scope.kind = ScopeKind::Other;
+                scope.name.clear();
+            }
+            scope.is_in_function_body = scope.kind == ScopeKind::Function or scope.kind == ScopeKind::Lambda
+                                        or (scope.kind == ScopeKind::Other and parent and parent->is_in_function_body);
+            scope.is_classified = true;
+        }
+
+        const Scope& classified(size_t scope_index)
+        {
+            auto& scope = scopes[scope_index];
+            if (not scope.is_classified)
+            {
+                classify_scope(scope, scope_index ? &classified(scope_index - 1) : nullptr);
+            }
+            return scope;
+        }
+
+        char next_non_space_character(size_t position) const
+        {
+            while (position != text_length and isspace(static_cast<unsigned char>(text[position]))) { ++position; }
+            return position == text_length ? '\0' : text[position];
+        }
+
+        // The word (if any) just before position, e.g. "else" for "else {".
+        std::string preceding_word(size_t position) const
+        {
+            while (position != 0 and isspace(static_cast<unsigned char>(text[position - 1]))) { --position; }
+            size_t word_begin = position;
+            while (word_begin != 0 and is_identifier_character(text[word_begin - 1])) { --word_begin; }
+            return std::string(text + word_begin, text + position);
+        }
+
+        bool has_offsets_before(size_t end) const
+        {
+            return answered_offset_count != offsets.size() and offsets[answered_offset_count] < end;
+        }
+
+        // Answers the offsets before end: the context is that of the enclosing scopes, plus declaration_name for offsets at or after declaration_start.
+        void answer_offsets_before(size_t end, const std::string& declaration_name = "", size_t declaration_start = 0)
+        {
+            if (not has_offsets_before(end)) { return; }
+
+            std::string context;
+            for (size_t i = 0; i != scopes.size(); ++i)
+            {
+                context += classified(i).name;
+            }
+            for (; has_offsets_before(end); ++answered_offset_count)
+            {
+                contexts[answered_offset_count] = context + (offsets[answered_offset_count] >= declaration_start ? declaration_name : "");
+            }
+        }
+
+      public:
+        Scanner(const char* text, size_t text_length, const std::vector<size_t>& offsets, std::vector<std::string>& contexts)
+          : text{text}, text_length{text_length}, offsets{offsets}, contexts{contexts}
+        {
+        }
+
+        void scan()
+        {
+            const char* const end = text + text_length;
+            size_t statement_begin = 0;
+            size_t parenthesis_depth = 0; // (of the statement so far)
+            for (const char* p = find_special_character(text, end); p != end and answered_offset_count != offsets.size(); p = find_special_character(p, end))
+            {
+                const size_t position = p - text;
+                switch (*p)
+                {
+                    case '{':
+                    {
+                        Scope scope{statement_begin, position, false, ScopeKind::Other, "", "", 0, false, false, parenthesis_depth};
+                        const auto word = preceding_word(position);
+                        scope.may_be_initializer = (not word.empty() and not is_one_of(word, {"else", "do", "try", "const", "override", "final", "noexcept", "mutable"}))
+                                                   or (position != 0 and text[position - 1] == '>');
+                        if (has_offsets_before(position))
+                        {
+                            classify_scope(scope, scopes.empty() ? nullptr : &classified(scopes.size() - 1));
+                            answer_offsets_before(position, scope.name, scope.start);
+                        }
+                        scopes.push_back(scope);
+                        statement_begin = position + 1;
+                        parenthesis_depth = 0;
+                        ++p;
+                        break;
+                    }
+                    case '}':
+                        answer_offsets_before(position + 1); // (The closing brace is within the scope.)
+                        statement_begin = position + 1;
+                        parenthesis_depth = 0;
+                        if (not scopes.empty())
+                        {
+                            if (scopes.back().parenthesis_depth != 0 // (e.g. "void f(std::vector<int> v = {1, 2}) {": the head continues.)
+                                or (scopes.back().may_be_initializer and is_one_of(std::string(1, next_non_space_character(position + 1)), {",", "{"}))) // (e.g. "S() : v{1, 2}, w{3} {": the head continues.)
+                            {
+                                statement_begin = scopes.back().head_begin;
+                                parenthesis_depth = scopes.back().parenthesis_depth;
+                            }
+                            scopes.pop_back();
+                        }
+                        ++p;
+                        break;
+                    case ';':
+                        if (has_offsets_before(position))
+                        {
+                            const Scope* parent = scopes.empty() ? nullptr : &classified(scopes.size() - 1);
+                            Scope declaration{statement_begin, position, true, ScopeKind::Other, "", "", 0, false, false, 0};
+                            if (not (parent and parent->is_in_function_body))
+                            {
+                                classify(text, statement_begin, position, /*has_body*/ false, parent, declaration);
+                            }
+                            answer_offsets_before(position, declaration.name, declaration.start);
+                        }
+                        statement_begin = position + 1;
+                        parenthesis_depth = 0;
+                        ++p;
+                        break;
+                    case '(':
+                        ++parenthesis_depth;
+                        ++p;
+                        break;
+                    case ')':
+                        if (parenthesis_depth) { --parenthesis_depth; }
+                        ++p;
+                        break;
+                    case '/':
+                        p = (p + 1 != end and (p[1] == '/' or p[1] == '*')) ? skip_comment(p, end) : p + 1;
+                        break;
+                    case '"':
+                        p = is_raw_string(text, p) ? skip_raw_string(p, end) : skip_quoted(p, end);
+                        break;
+                    case '\'':
+                        p = is_digit_separator(text, p) ? p + 1 : skip_quoted(p, end);
+                        break;
+                    case '#':
+                        p = is_at_start_of_line(text, p) ? skip_preprocessor_line(p, end) : p + 1;
+                        break;
+                }
+            }
+            answer_offsets_before(size_t(-1));
+        }
+    };
+}
+
+
+// Returns the approximate context of each of sorted_offsets (which must be sorted) in text, answering all of them in a single scan (which stops after the last offset).
+std::vector<std::string> get_approximate_contexts(const char* text, size_t text_length, const std::vector<size_t>& sorted_offsets)
+{
+    std::vector<std::string> contexts(sorted_offsets.size());
+    LexicalScan::Scanner(text, text_length, sorted_offsets, contexts).scan();
+    return contexts;
+}
+
+
+std::string get_approximate_context(const char* text, size_t text_length, size_t offset)
+{
+    return get_approximate_contexts(text, text_length, {offset}).front();
+}
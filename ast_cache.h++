@@ -0,0 +1,161 @@
+// An on-disk cache of parsed translation units ("AST files"), so that a translation unit only has to be parsed again after one of its files changes.
+
+#pragma once
+
+#include "compilation_environments.h++"
+#include "libclang++.h++"
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio> // rename, remove
+#include <cstring> // strerror
+#include <ctime> // time
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h> // getcwd, getpid
+
+
+uint64_t fnv1a_hash(const std::string& s)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char c : s)
+    {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+// For each translation unit two files are kept in the cache directory:
+//   <hash>-<unique suffix>.ast - the translation unit, as saved by clang_saveTranslationUnit(), and
+//   <hash>.files               - the name of the .ast file, then the modification time and name of each file in the translation unit, one per line.
+// <hash> is a hash of the source file name and compile command (see translation_unit_key()). A cache entry is only used if none of its files have been modified since it was saved.
+// Each save writes a new .ast file (which is never modified) before renaming the .files file into place, so a .files file and the .ast file it names always go together, however many processes are using the cache.
+// XXX File modification times only have a resolution of one second - a file modified in the same second as it was parsed won't invalidate the cache entry.
+class AstCache
+{
+    std::string cache_directory;
+
+    std::string entry_name(const CompilationEnv& compilation_environment) const
+    {
+        std::ostringstream oss;
+        oss << std::hex << fnv1a_hash(translation_unit_key(compilation_environment));
+        return oss.str();
+    }
+
+    static bool is_ast_file_name(const std::string& name) // (so that a corrupt .files file can't name a file outside the cache directory)
+    {
+        return name.length() > 4 and name.compare(name.length() - 4, 4, ".ast") == 0 and name.find('/') == std::string::npos;
+    }
+
+    // Reads the name of the .ast file from a .files file. Returns false if it can't, or if any of the files listed have been modified.
+    static bool are_files_unchanged(const std::string& files_pathname, std::string& ast_file_name)
+    {
+        std::ifstream files(files_pathname);
+        if (not std::getline(files, ast_file_name) or not is_ast_file_name(ast_file_name)) { return false; }
+
+        for (std::string line; std::getline(files, line); )
+        {
+            std::istringstream iss(line);
+            long long saved_modification_time;
+            std::string file_name;
+            struct stat file_status;
+            if (not (iss >> saved_modification_time) or not std::getline(iss >> std::ws, file_name)
+                or stat(file_name.c_str(), &file_status)
+                or file_status.st_mtime != saved_modification_time)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+  public:
+    explicit AstCache(const std::string& directory)
+      : cache_directory{directory}
+    {
+        if (cache_directory.empty() or cache_directory[0] != '/') // (Make absolute as the current directory is changed before parsing.)
+        {
+            char cwd[4096];
+            if (not getcwd(cwd, sizeof(cwd)))
+            {
+                throw std::runtime_error(std::string("getcwd failed. ") + strerror(errno));
+            }
+            cache_directory = cwd + ('/' + cache_directory);
+        }
+        if (mkdir(cache_directory.c_str(), 0777) and errno != EEXIST)
+        {
+            throw std::runtime_error("Unable to create cache directory " + cache_directory + ". " + strerror(errno));
+        }
+    }
+
+    // Returns the cached translation unit, or null if there isn't an up-to-date one.
+    std::unique_ptr<Libclang::TranslationUnit> load(Libclang::TranslationUnitContext& translation_unit_context, const CompilationEnv& compilation_environment) const
+    {
+        std::string ast_file_name;
+        if (not are_files_unchanged(cache_directory + '/' + entry_name(compilation_environment) + ".files", ast_file_name))
+        {
+            return nullptr;
+        }
+        try
+        {
+            return std::unique_ptr<Libclang::TranslationUnit>{new Libclang::TranslationUnit(translation_unit_context, (cache_directory + '/' + ast_file_name).c_str())};
+        }
+        catch (const std::runtime_error&) // (e.g. another process has just replaced the entry and removed this .ast file.)
+        {
+            return nullptr;
+        }
+    }
+
+    // Saves translation_unit (which should have been parsed with CXTranslationUnit_ForSerialization). Failure to save isn't an error; there just won't be a cache entry.
+    // XXX If two processes save the same entry at the same time, the .ast file of the one whose .files file is replaced first may be left behind.
+    void save(Libclang::TranslationUnit& translation_unit, const CompilationEnv& compilation_environment) const
+    {
+        static std::atomic<unsigned> save_count{0};
+        const auto name = entry_name(compilation_environment);
+        const auto files_pathname = cache_directory + '/' + name + ".files";
+        const auto ast_file_name = name + '-' + std::to_string(getpid()) + '-' + std::to_string(time(nullptr)) + '-' + std::to_string(++save_count) + ".ast"; // (unique)
+        const auto ast_pathname = cache_directory + '/' + ast_file_name;
+        const auto temporary_files_pathname = files_pathname + ".tmp" + std::to_string(getpid()); // (Other processes may be using the same cache entry; the .files file is only renamed into place once complete.)
+
+        try
+        {
+            translation_unit.save(ast_pathname.c_str());
+        }
+        catch (const std::runtime_error&) // (e.g. the translation unit has errors.)
+        {
+            remove(ast_pathname.c_str());
+            return;
+        }
+
+        std::ofstream files(temporary_files_pathname);
+        files << ast_file_name << '\n';
+        Libclang::visit_inclusions(translation_unit,
+                [&files](CXFile file)
+                {
+                    files << static_cast<long long>(clang_getFileTime(file)) << ' ' << static_cast<const char*>(Libclang::String{clang_getFileName(file)}) << '\n';
+                });
+        files.close();
+
+        std::string previous_ast_file_name;
+        {
+            std::ifstream previous_files(files_pathname);
+            std::getline(previous_files, previous_ast_file_name);
+        }
+
+        if (not files or rename(temporary_files_pathname.c_str(), files_pathname.c_str()))
+        {
+            remove(temporary_files_pathname.c_str());
+            remove(ast_pathname.c_str());
+            return;
+        }
+        if (is_ast_file_name(previous_ast_file_name) and previous_ast_file_name != ast_file_name)
+        {
+            remove((cache_directory + '/' + previous_ast_file_name).c_str());
+        }
+    }
+};
@@ -0,0 +1,125 @@
+// Measures parse time and query latency for generated source files of increasing size and nesting depth. (Run by "make bench".)
+
+#include "libclang++.h++"
+#include <algorithm> // sort, min
+#include <chrono>
+#include <cstdio> // printf, fprintf
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility> // pair
+#include <vector>
+
+
+// Returns a source file of unit_count units, each of which is depth nested namespaces containing a class template with a member function containing nested lambdas (and an out-of-class member function definition).
+std::string generate_source(size_t unit_count, size_t depth)
+{
+    std::string source;
+    for (size_t unit = 0; unit != unit_count; ++unit)
+    {
+        const auto u = std::to_string(unit);
+        for (size_t d = 0; d != depth; ++d)
+        {
+            source += "namespace N" + u + "_" + std::to_string(d) + " {\n";
+        }
+        source += "template <typename T> struct S" + u + " {\n"
+                  "    struct Inner { int g(); };\n"
+                  "    T f(T t) {\n"
+                  "        auto outer = [t](int i) {\n"
+                  "            auto inner = [i, t]() { return t + T(i); /*QUERY*/ };\n"
+                  "            return inner();\n"
+                  "        };\n"
+                  "        return outer(" + u + ");\n"
+                  "    }\n"
+                  "};\n"
+                  "inline int f" + u + "() { return S" + u + "<int>().f(1); }\n"
+                  "enum E" + u + " { A" + u + ", B" + u + " };\n";
+        for (size_t d = 0; d != depth; ++d)
+        {
+            source += "}\n";
+        }
+        source += "template <> int " + std::string(depth ? "N" + u + "_0::" : "");
+        for (size_t d = 1; d < depth; ++d)
+        {
+            source += "N" + u + "_" + std::to_string(d) + "::";
+        }
+        source += "S" + u + "<int>::Inner::g() { return 0; }\n";
+    }
+    return source;
+}
+
+
+double percentile(const std::vector<double>& sorted_values, double p)
+{
+    return sorted_values[std::min(sorted_values.size() - 1, size_t(p / 100 * sorted_values.size()))];
+}
+
+
+double time_microseconds(const std::function<void()>& f)
+{
+    const auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+int main()
+{
+    const size_t query_repetitions = 100; // (so that p90 isn't just one of the slowest few - no higher percentile is reported, as it would be little more than the max)
+
+    printf("%6s %6s %10s %10s  %-26s %-7s %10s %10s %10s\n",
+           "units", "depth", "bytes", "parse (ms)", "method", "query", "p50 (us)", "p90 (us)", "max (us)");
+
+    for (const size_t unit_count : {10, 100, 1000})
+    {
+        for (const size_t depth : {1, 4, 16})
+        {
+            const auto source = generate_source(unit_count, depth);
+
+            Libclang::TranslationUnitContext translation_unit_context;
+            std::unique_ptr<Libclang::TranslationUnit> translation_unit;
+            const auto parse_microseconds = time_microseconds([&]()
+                    {
+                        translation_unit.reset(new Libclang::TranslationUnit(translation_unit_context, "bench_program.c++",
+                                /*command_line_args*/ {"-std=c++11"},
+                                /*unsaved_files*/ {{"bench_program.c++", source.c_str(), source.length()}},
+                                /*options*/ CXTranslationUnit_None));
+                    });
+            if (clang_getNumDiagnostics(*translation_unit)) // (The diagnostics have been output to stderr. Timings of a translation unit with errors would be meaningless, as libclang drops what it can't parse.)
+            {
+                fprintf(stderr, "Libclang generated diagnostic message/s for the source of %zu units of depth %zu.\n", unit_count, depth);
+                return 1;
+            }
+
+            std::vector<size_t> query_offsets; // (of the innermost lambda of every unit)
+            for (auto i = source.find("/*QUERY*/"); i != std::string::npos; i = source.find("/*QUERY*/", i+1))
+            {
+                query_offsets.push_back(i);
+            }
+
+            const std::pair<const char*, size_t> queries[] = {{"start", query_offsets.front()},
+                                                              {"middle", query_offsets[query_offsets.size() / 2]},
+                                                              {"end", query_offsets.back()}};
+            const std::pair<const char*, std::function<std::string(size_t)>> methods[] = {
+                {"get_context()", [&](size_t offset) { return get_context(*translation_unit, offset); }},
+                {"get_context_by_full_walk()", [&](size_t offset) { return get_context_by_full_walk(*translation_unit, offset); }}};
+
+            for (const auto& method : methods)
+            {
+                for (const auto& query : queries)
+                {
+                    std::vector<double> latencies;
+                    for (size_t i = 0; i != query_repetitions; ++i)
+                    {
+                        latencies.push_back(time_microseconds([&]() { method.second(query.second); }));
+                    }
+                    std::sort(latencies.begin(), latencies.end());
+
+                    printf("%6zu %6zu %10zu %10.1f  %-26s %-7s %10.1f %10.1f %10.1f\n",
+                           unit_count, depth, source.length(), parse_microseconds / 1e3, method.first, query.first,
+                           percentile(latencies, 50), percentile(latencies, 90), latencies.back());
+                }
+            }
+        }
+    }
+}
@@ -1,5 +1,13 @@
 #include "libclang++.h++"
+#include <algorithm> // equal, lower_bound, upper_bound, max, min
+#include <functional>
 #include <map>
+#include <string>
+#include <vector>
+
+
+thread_local size_t visited_cursor_count = 0; // (by get_context() and get_contexts() on this thread, for --stats)
+thread_local size_t full_walk_fallback_count = 0; // (queries that get_context() couldn't answer by walking up from the query position, on this thread, for --stats)
 
 
 std::string class_name_with_double_colons(CXCursor cursor) // returns nested class names, if any
@@ -59,41 +67,183 @@ static std::string scope_name(const CXCursor& cursor)
 }
 
 
-std::string get_context(/*const*/ Libclang::TranslationUnit& translation_unit, const size_t main_file_offset)
+// Returns a function that returns whether a source location is in file.
+// CXFiles can't just be compared with ==: libclang (e.g. version 18) can have several CXFiles for a header file that's included by different spellings. So CXFileUniqueIDs are compared if the CXFiles differ.
+std::function<bool(const CXSourceLocation&)> is_in_given_file_fn(const CXFile file)
 {
-    std::string result;
+    CXFileUniqueID id;
+    const bool has_id = clang_getFileUniqueID(file, &id) == 0;
+    return [file, id, has_id](const CXSourceLocation& location)
+            {
+                const CXFile location_file = Libclang::get_file(location);
+                CXFileUniqueID location_file_id;
+                return location_file == file
+                    or (has_id and location_file and clang_getFileUniqueID(location_file, &location_file_id) == 0
+                        and std::equal(id.data, id.data + 3, location_file_id.data));
+            };
+}
+
 
+// Returns a function that returns whether a source location is in file (or in the translation unit's main file if file is null).
+std::function<bool(const CXSourceLocation&)> is_in_file_fn(/*const*/ Libclang::TranslationUnit& translation_unit, const CXFile file)
+{
 #if CINDEX_VERSION < CINDEX_VERSION_ENCODE(0, 20)
-    const CXFile main_file {Libclang::get_main_file(translation_unit)};
-    const auto clang_Location_isFromMainFile = [&main_file](const CXSourceLocation &location){ return main_file == Libclang::get_file(location); }; // XXX is it ok to compare CXFiles with ==? Should I be comparing CXFileUniqueIDs (and using clang_getFileUniqueID()?)
+    return is_in_given_file_fn(file ? file : Libclang::get_main_file(translation_unit));
+#else
+    (void)translation_unit;
+    if (file)
+    {
+        return is_in_given_file_fn(file);
+    }
+    return [](const CXSourceLocation& location){ return clang_Location_isFromMainFile(location) != 0; };
 #endif
+}
+
+
+// Returns the context, within root, of each of file_offsets (offsets in file, which must be sorted), answering all of them in a single traversal of root's descendants.
+std::vector<std::string> get_contexts_within(/*const*/ Libclang::TranslationUnit& translation_unit, const CXCursor& root, const std::vector<size_t>& file_offsets, const CXFile file = nullptr /*main file*/)
+{
+    std::vector<std::string> results(file_offsets.size());
+
+    const auto is_in_file = is_in_file_fn(translation_unit, file);
+
+    // Each node visited "owns" the (contiguous) run of query offsets that lie within it and within all of its ancestors.
+    struct VisitedNode { CXCursor cursor; size_t first_offset_index, end_offset_index; };
+    std::vector<VisitedNode> ancestors {{root, 0, file_offsets.size()}};
 
-    Libclang::visit_children(translation_unit.get_cursor(),
-            [&](const CXCursor& cursor, const CXCursor& /*parent*/)
+    // An offset is "answered" once a node starting after it has been visited (the single offset traversal stops at such a node).
+    size_t answered_offset_count = 0;
+
+    Libclang::visit_children(root,
+            [&](const CXCursor& cursor, const CXCursor& parent)
             {
+                ++visited_cursor_count;
+                while (ancestors.back().cursor != parent) { ancestors.pop_back(); }
+
                 const auto cursor_extent = clang_getCursorExtent(cursor);
 
-                const bool is_cursor_start_in_main_file = clang_Location_isFromMainFile(clang_getRangeStart(cursor_extent));
-                const bool is_cursor_end_in_main_file = clang_Location_isFromMainFile(clang_getRangeEnd(cursor_extent));
+                const bool is_cursor_start_in_file = is_in_file(clang_getRangeStart(cursor_extent));
+                const bool is_cursor_end_in_file = is_in_file(clang_getRangeEnd(cursor_extent));
 
-                if (not (is_cursor_start_in_main_file or is_cursor_end_in_main_file)) // "if cursor is not for an AST element in the 'main' file"  XXX This condition doesn't correctly handle the (very unlikely) case where an AST element relates to part of the main file even though the start and end of the AST element are not in the main file.
+                if (not (is_cursor_start_in_file or is_cursor_end_in_file)) // "if cursor is not for an AST element in the file"  XXX This condition doesn't correctly handle the (very unlikely) case where an AST element relates to part of the file even though the start and end of the AST element are not in the file.
                 {
                     return Libclang::NextNode::Sibling;
                 }
-                if (is_cursor_end_in_main_file
-                    and Libclang::get_one_beyond_end_offset(cursor_extent) <= main_file_offset)
+
+                auto end_offset = file_offsets.begin() + ancestors.back().end_offset_index;
+                auto first_offset = std::min(end_offset, file_offsets.begin() + std::max(ancestors.back().first_offset_index, answered_offset_count));
+                if (is_cursor_end_in_file)
                 {
-                    return Libclang::NextNode::Sibling;
+                    end_offset = std::lower_bound(first_offset, end_offset, Libclang::get_one_beyond_end_offset(cursor_extent));
                 }
-                if (is_cursor_start_in_main_file
-                    and Libclang::get_start_offset(cursor_extent) > main_file_offset)
+                if (is_cursor_start_in_file)
                 {
-                    return Libclang::NextNode::None;
+                    const auto start_offset = Libclang::get_start_offset(cursor_extent);
+                    answered_offset_count = std::max<size_t>(answered_offset_count,
+                            std::lower_bound(file_offsets.begin(), file_offsets.end(), start_offset) - file_offsets.begin());
+                    if (answered_offset_count == file_offsets.size())
+                    {
+                        return Libclang::NextNode::None;
+                    }
+                    first_offset = std::lower_bound(first_offset, end_offset, start_offset);
+                }
+                if (first_offset == end_offset)
+                {
+                    return Libclang::NextNode::Sibling;
                 }
 
-                result += scope_name(cursor);
+                const auto name = scope_name(cursor);
+                for (auto it = first_offset; it != end_offset; ++it)
+                {
+                    results[it - file_offsets.begin()] += name;
+                }
+                ancestors.push_back({cursor, size_t(first_offset - file_offsets.begin()), size_t(end_offset - file_offsets.begin())});
                 return Libclang::NextNode::Child;
             });
 
-    return result;
+    return results;
+}
+
+
+std::string get_context_by_full_walk(/*const*/ Libclang::TranslationUnit& translation_unit, const size_t file_offset, const CXFile file = nullptr /*main file*/)
+{
+    return get_contexts_within(translation_unit, translation_unit.get_cursor(), {file_offset}, file).front();
+}
+
+
+// Finds the innermost declaration at file_offset and the declarations that lexically enclose it (outermost first), i.e. the path to it from the top of the AST.
+// Returns false if the path found might not be the path that get_context_by_full_walk() would follow. (Cursors are only accepted if they are the ones get_context_by_full_walk() would visit and if they enclose file_offset by its rules.)
+bool get_enclosing_declarations(/*const*/ Libclang::TranslationUnit& translation_unit, const size_t file_offset, const CXFile file, std::vector<CXCursor>& declarations)
+{
+    const auto is_in_file = is_in_file_fn(translation_unit, file);
+
+    const CXSourceLocation location = clang_getLocationForOffset(translation_unit, file ? file : Libclang::get_main_file(translation_unit), file_offset);
+    CXCursor cursor = clang_getCursor(translation_unit, location);
+
+    if (clang_isStatement(clang_getCursorKind(cursor)) or clang_isExpression(clang_getCursorKind(cursor)))
+    {
+        cursor = clang_getCursorSemanticParent(cursor); // (Libclang returns the declaration that contains the statement/expression. Note: lambdas aren't declarations - any that enclose the statement/expression will be skipped over.)
+    }
+
+    for (; not clang_isTranslationUnit(clang_getCursorKind(cursor)); cursor = clang_getCursorLexicalParent(cursor))
+    {
+        ++visited_cursor_count;
+        if (not clang_isDeclaration(clang_getCursorKind(cursor)))
+        {
+            return false;
+        }
+
+        // Use the cursor get_context_by_full_walk() would visit for the declaration, e.g. a CXCursor_ClassTemplate rather than the CXCursor_ClassDecl for the class it describes.
+        const CXCursor visited_cursor = clang_getCursor(translation_unit, clang_getCursorLocation(cursor));
+        if (not clang_isDeclaration(clang_getCursorKind(visited_cursor))
+            or not clang_equalLocations(clang_getCursorLocation(visited_cursor), clang_getCursorLocation(cursor)))
+        {
+            return false;
+        }
+
+        const auto extent = clang_getCursorExtent(visited_cursor);
+        const bool is_start_in_file = is_in_file(clang_getRangeStart(extent));
+        const bool is_end_in_file = is_in_file(clang_getRangeEnd(extent));
+        if (not (is_start_in_file or is_end_in_file)
+            or (is_end_in_file and Libclang::get_one_beyond_end_offset(extent) <= file_offset)
+            or (is_start_in_file and Libclang::get_start_offset(extent) > file_offset))
+        {
+            return false;
+        }
+
+        declarations.insert(declarations.begin(), visited_cursor);
+    }
+    return not declarations.empty() /*(leave top-level queries to get_context_by_full_walk() - it has to visit the whole translation unit's top-level declarations anyway)*/;
+}
+
+
+// Unlike get_context_by_full_walk(), the time taken doesn't depend on the amount of code before file_offset: the declarations enclosing file_offset are found by walking up from the cursor at file_offset, then only the innermost declaration's descendants are visited (to find enclosing lambdas).
+// get_context_by_full_walk() is used if the enclosing declarations can't be reliably determined.
+std::string get_context(/*const*/ Libclang::TranslationUnit& translation_unit, const size_t file_offset, const CXFile file = nullptr /*main file*/)
+{
+    std::vector<CXCursor> enclosing_declarations;
+    if (not get_enclosing_declarations(translation_unit, file_offset, file, enclosing_declarations))
+    {
+        ++full_walk_fallback_count;
+        return get_context_by_full_walk(translation_unit, file_offset, file);
+    }
+
+    std::string result;
+    for (const auto& declaration : enclosing_declarations)
+    {
+        result += scope_name(declaration);
+    }
+    return result + get_contexts_within(translation_unit, enclosing_declarations.back(), {file_offset}, file).front();
+}
+
+
+// Returns the context of each of file_offsets (offsets in file, which must be sorted), answering all of them in a single traversal of the AST. (A single offset is answered by get_context() instead.)
+// file is the translation unit's main file by default, but it may be any file included by the translation unit.
+std::vector<std::string> get_contexts(/*const*/ Libclang::TranslationUnit& translation_unit, const std::vector<size_t>& file_offsets, const CXFile file = nullptr /*main file*/)
+{
+    if (file_offsets.size() == 1)
+    {
+        return {get_context(translation_unit, file_offsets[0], file)};
+    }
+    return get_contexts_within(translation_unit, translation_unit.get_cursor(), file_offsets, file);
 }
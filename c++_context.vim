@@ -1,14 +1,155 @@
+" Displays the context of the cursor position in C and C++ buffers.
+" Requests go to a long-lived "c++_context --server" process (started when first needed) by way of Vim's job/channel API, so Vim doesn't wait
+" for parses. The buffer's contents are sent if it has unsaved changes. Requests are debounced as the cursor moves; a reply to a request that
+" has been superseded (by a later cursor position) is dropped.
+"
+" Options (set before sourcing this file):
+"   g:cpp_context_display      'statusline' (the default; add %{CppContextStatusline()} to 'statusline'), 'popup' or 'echo'
+"   g:cpp_context_auto         1 (the default) to update the context as the cursor moves, 0 to only update it with <localleader>c
+"   g:cpp_context_delay        milliseconds the cursor has to stay still before a request is sent (default 150)
+"   g:cpp_context_server_args  extra arguments for c++_context, e.g. ['--approximate'] (default [])
+
 let cpp_context_path = expand('<sfile>:p:h')
 
+let g:cpp_context_display = get(g:, 'cpp_context_display', 'statusline')
+let g:cpp_context_auto = get(g:, 'cpp_context_auto', 1)
+let g:cpp_context_delay = get(g:, 'cpp_context_delay', 150)
+let g:cpp_context_server_args = get(g:, 'cpp_context_server_args', [])
+
 function! Cursor_byte_offset_from_start_of_file()
     return (line2byte(line("."))-1) + (col(".")-1)
 endfunction
 
+function! CppContextStatusline()
+    return get(b:, 'cpp_context', '')
+endfunction
+
+
+if !(has('job') && has('channel') && has('timers'))
+    " XXX Without jobs, Vim waits for c++_context, and unsaved changes are ignored.
+    autocmd FileType c,cpp
+        \ nnoremap <buffer> <silent> <localleader>c
+        \   :echo "-----\n"
+        \    .system(shellescape(cpp_context_path."/c++_context")
+        \            ." ".shellescape(expand('%:p'))
+        \            ." ".Cursor_byte_offset_from_start_of_file())<CR>
+    finish
+endif
+
+
+let s:job = ''
+let s:response_lines = []     " (of the response being received)
+let s:requests_in_flight = [] " (sent but not yet answered, oldest first; the server answers in order)
+let s:pending_request = {}    " (to be sent when the requests in flight have been answered; only the latest is kept)
+let s:latest_request_id = 0
+let s:timer = -1
+
+function! s:start_server()
+    let s:job = job_start([g:cpp_context_path.'/c++_context'] + g:cpp_context_server_args + ['--server'], {
+        \ 'cwd': expand('%:p:h'),
+        \ 'in_mode': 'raw',
+        \ 'out_mode': 'nl',
+        \ 'out_cb': function('s:on_output'),
+        \ 'err_mode': 'nl',
+        \ 'err_cb': function('s:on_error'),
+        \ 'exit_cb': function('s:on_exit')})
+endfunction
+
+function! s:on_exit(job, status)
+    let s:job = ''
+    let s:response_lines = []
+    let s:requests_in_flight = []
+endfunction
+
+" The server only writes to stderr when it fails (compiler diagnostics aren't output).
+function! s:on_error(channel, message)
+    echomsg 'c++_context: '.a:message
+endfunction
+
+" Each response is a status line ("ok" or "error: message"), the context's lines and an empty line.
+function! s:on_output(channel, line)
+    if a:line != ''
+        call add(s:response_lines, a:line)
+        return
+    endif
+    let l:status = get(s:response_lines, 0, '')
+    let l:lines = l:status ==# 'ok' ? s:response_lines[1:] : ['[ERROR: '.substitute(l:status, '^error: ', '', '').']']
+    let s:response_lines = []
+    if empty(s:requests_in_flight)
+        return
+    endif
+
+    let l:request = remove(s:requests_in_flight, 0)
+    if l:request.id == s:latest_request_id " (Otherwise the reply is stale.)
+        call s:display(l:request, l:lines)
+    endif
+    if empty(s:requests_in_flight) && !empty(s:pending_request)
+        call s:send(s:pending_request)
+        let s:pending_request = {}
+    endif
+endfunction
+
+function! s:display(request, lines)
+    if a:request.display == 'statusline'
+        if bufexists(a:request.buffer)
+            call setbufvar(a:request.buffer, 'cpp_context', join(a:lines, ' / '))
+            redrawstatus!
+        endif
+    elseif a:request.buffer != bufnr('%')
+        return
+    elseif a:request.display == 'popup' && exists('*popup_atcursor')
+        call popup_atcursor(empty(a:lines) ? ['(global scope)'] : a:lines, {'moved': 'any'})
+    else
+        echo join(['-----'] + a:lines, "\n")
+    endif
+endfunction
+
+function! s:send(request)
+    if type(s:job) != v:t_job || job_status(s:job) != 'run'
+        call s:start_server()
+    endif
+    call ch_sendraw(job_getchannel(s:job), a:request.data)
+    call add(s:requests_in_flight, {'id': a:request.id, 'buffer': a:request.buffer, 'display': a:request.display})
+endfunction
+
+" Requests the context of the cursor position; display is how to show it (see g:cpp_context_display).
+function! s:request(display)
+    let l:pathname = expand('%:p')
+    if l:pathname == ''
+        return
+    endif
+
+    " (A request is "zero-based_offset unsaved_contents_length pathname", followed by the unsaved contents, if any. See serve() in main.c++.)
+    let l:contents = ''
+    if &modified
+        let l:contents = join(getline(1, '$'), &fileformat == 'dos' ? "\r\n" : "\n") . (&endofline || &fixendofline ? (&fileformat == 'dos' ? "\r\n" : "\n") : '')
+    endif
+    let s:latest_request_id += 1
+    let l:request = {
+        \ 'id': s:latest_request_id,
+        \ 'buffer': bufnr('%'),
+        \ 'display': a:display,
+        \ 'data': Cursor_byte_offset_from_start_of_file().' '.strlen(l:contents).' '.l:pathname."\n".l:contents}
+
+    if empty(s:requests_in_flight)
+        call s:send(l:request)
+    else
+        let s:pending_request = l:request
+    endif
+endfunction
+
+function! s:on_cursor_moved()
+    call timer_stop(s:timer)
+    let s:timer = timer_start(g:cpp_context_delay, {timer -> s:request(g:cpp_context_display)})
+endfunction
+
 
-" XXX Unsaved changes will be ignored! XXX
-autocmd FileType c,cpp
-    \ nnoremap <buffer> <silent> <localleader>c
-    \   :echo "-----\n"
-    \    .system(shellescape(cpp_context_path."/c++_context")
-    \            ." ".shellescape(expand('%:p'))
-    \            ." ".Cursor_byte_offset_from_start_of_file())<CR>
+augroup cpp_context
+    autocmd!
+    autocmd FileType c,cpp
+        \ nnoremap <buffer> <silent> <localleader>c :call <SID>request('echo')<CR>
+    if g:cpp_context_auto
+        autocmd FileType c,cpp
+            \ autocmd! cpp_context CursorMoved,CursorMovedI <buffer> call s:on_cursor_moved()
+    endif
+augroup END
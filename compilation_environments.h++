@@ -0,0 +1,559 @@
+// Compiler options (from a "compilation database") for each source file (and header file).
+
+#pragma once
+
+#include "libclang++.h++"
+#include "mapped_file.h++"
+#include <clang/Tooling/CompilationDatabase.h>
+#include <clang/Tooling/JSONCompilationDatabase.h>
+#include <algorithm> // all_of, copy, equal, find
+#include <cerrno>
+#include <cstdint>
+#include <cstdio> // rename, remove
+#include <cstdlib> // realpath, free
+#include <cstring> // strcmp, strerror
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h> // chdir, getpid
+#include <utility> // pair
+#include <vector>
+
+
+struct CompilationEnv // (The data pointed to is owned by the CompilationEnvironments object that returned this.)
+{
+    std::string main_file; // the source file to parse; for a header file, a source file that includes the header
+    const char* directory;
+    std::vector<const char*> arguments; // compiler arguments, less the compiler, the source file, and -c and -o options
+};
+
+
+std::string file_extension(const std::string& s)
+{
+    const auto i = s.rfind('.');
+    return (i == std::string::npos) ? "" : s.substr(i+1);
+}
+
+bool has_cpp_source_file_extension(const std::string& s)
+{
+    static const std::vector<std::string> cpp_source_file_extensions {"cpp", "c++", "cxx", "cc", "C", "c"};
+    return std::find(cpp_source_file_extensions.begin(), cpp_source_file_extensions.end(), file_extension(s))
+                    != cpp_source_file_extensions.end();
+}
+
+
+std::string canonical_pathname(const char* pathname) // (absolute, without symbolic links)
+{
+    char* p = realpath(pathname, /*resolved_path*/ NULL);
+    if (not p) { return pathname; }
+    const std::string canonical{p};
+    free(p);
+    return canonical;
+}
+
+std::string canonical_pathname(const std::string& pathname, const std::string& directory) // (for a pathname relative to directory, rather than to the current directory)
+{
+    return canonical_pathname((pathname.empty() or pathname[0] == '/' ? pathname : directory + '/' + pathname).c_str());
+}
+
+
+// Returns the arguments (from a compile command) that are to be passed to clang_parseTranslationUnit().
+std::vector<std::string> filter_compiler_arguments(const std::vector<std::string>& command_line)
+{
+    std::vector<std::string> args;
+
+    for (auto arg_it = command_line.begin() + 1 /*skip compiler*/;
+         arg_it < command_line.end();
+         ++arg_it)
+    {
+        // Filter out the source filename as we ultimately pass the source filename via a separate argument to clang_parseTranslationUnit, otherwise it won't create the translation unit.
+        if ("-c" == *arg_it or "-o" == *arg_it)
+        {
+            ++arg_it;
+        }
+        else if (not ((*arg_it)[0] != '-' and has_cpp_source_file_extension(*arg_it)) /*XXX <- A hack (?) to check if arg isn't source file to compile and link - should probably use clang::tooling::CommonOptionsParser::getSourcePathList() */)
+        {
+            args.push_back(*arg_it);
+            if ("-include" == *arg_it and arg_it + 1 != command_line.end())
+            {
+                args.push_back(*++arg_it); // (Ensure include files aren't filtered out.)
+            }
+        }
+    }
+    return args;
+}
+
+
+std::vector<const char*> get_environment_arguments(const CompilationEnv& env)
+{
+    return env.arguments;
+}
+
+// For parsing without changing the current directory to the compilation environment's directory (which is shared by all threads).
+std::vector<const char*> get_environment_arguments_with_working_directory(const CompilationEnv& env)
+{
+    auto args = get_environment_arguments(env);
+    args.push_back("-working-directory");
+    args.push_back(env.directory);
+    return args;
+}
+
+
+// Returns the file of a translation unit (parsed for compilation_environment) to query for pathname, which may be the main file or a header file that it includes. (Null means the main file.)
+// pathname must be canonical (see canonical_pathname()) - it's usually needed after the current directory has been changed to the compilation environment's directory.
+CXFile get_query_file(CXTranslationUnit translation_unit, const CompilationEnv& compilation_environment, const std::string& pathname)
+{
+    return (pathname == compilation_environment.main_file) ? nullptr : Libclang::get_file(translation_unit, pathname.c_str());
+}
+
+
+// Returns a string that identifies the translation unit that would be parsed for compilation_environment.
+std::string translation_unit_key(const CompilationEnv& compilation_environment)
+{
+    std::string key = compilation_environment.main_file + '\0' + compilation_environment.directory;
+    for (const auto arg : compilation_environment.arguments)
+    {
+        key += '\0' + std::string(arg);
+    }
+    return key;
+}
+
+
+// The compilation database is read from compile_commands.json, but only when it has changed since it was last read. An index of it is kept in a "sidecar" file, <compile_commands.json>.c++_context, that can be used without any parsing:
+//   CompilationDatabaseIndexHeader
+//   CompilationDatabaseIndexEntry[entry_count]  - sorted by pathname (canonical absolute pathnames)
+//   uint32_t argument_offsets[argument_count]   - each entry's arguments are contiguous
+//   null terminated strings
+// Offsets are from the start of the strings.
+struct CompilationDatabaseIndexHeader
+{
+    char magic[8];
+    int64_t json_modification_time;
+    uint64_t json_size;
+    uint32_t entry_count;
+    uint32_t argument_count;
+};
+
+struct CompilationDatabaseIndexEntry
+{
+    uint32_t pathname_offset;
+    uint32_t directory_offset;
+    uint32_t first_argument, argument_count;
+};
+
+const char compilation_database_index_magic[8] = {'C', '+', '+', 'C', 'T', 'X', 'D', '1'};
+
+
+// For header files (which don't have their own compile commands) a source file that includes the header is used. <compile_commands.json>.c++_context-headers records the smallest (i.e. fewest files) translation unit seen to include each header:
+//   HeaderMapHeader
+//   HeaderMapEntry[entry_count]  - sorted by header pathname
+//   null terminated strings
+struct HeaderMapHeader
+{
+    char magic[8];
+    uint32_t entry_count;
+    uint32_t reserved;
+};
+
+struct HeaderMapEntry
+{
+    uint32_t header_offset;
+    uint32_t main_file_offset;
+    uint32_t main_file_file_count; // (the number of files in main_file's translation unit)
+};
+
+const char header_map_magic[8] = {'C', '+', '+', 'C', 'T', 'X', 'H', '1'};
+
+
+// Returns the index of the first element of table (of element_count elements) whose string (at strings + string_offset(element)) isn't less than s.
+template<typename T, typename T_StringOffsetFunction>
+size_t lower_bound_by_string(const T* table, size_t element_count, const char* strings, T_StringOffsetFunction string_offset, const char* s)
+{
+    size_t first = 0;
+    while (element_count)
+    {
+        const size_t half = element_count / 2;
+        if (strcmp(strings + string_offset(table[first + half]), s) < 0)
+        {
+            first += half + 1;
+            element_count -= half + 1;
+        }
+        else
+        {
+            element_count = half;
+        }
+    }
+    return first;
+}
+
+
+class CompilationEnvironments
+{
+    std::string database_pathname; // (compile_commands.json)
+
+    std::unique_ptr<MappedFile> mapped_index;
+    std::string unsaved_index; // (Used if the index couldn't be written to disk.)
+    const CompilationDatabaseIndexHeader* index_header;
+    const CompilationDatabaseIndexEntry* index_entries;
+    const uint32_t* argument_offsets;
+    const char* index_strings;
+
+    std::mutex header_map_mutex; // (Translation units may be parsed, and their inclusions recorded, on several threads.)
+    std::unique_ptr<MappedFile> mapped_header_map;
+
+    static std::string find_compilation_database()
+    {
+        std::string directory = canonical_pathname(".");
+        while (true)
+        {
+            const auto pathname = (directory == "/" ? "" : directory) + "/compile_commands.json";
+            struct stat file_status;
+            if (stat(pathname.c_str(), &file_status) == 0)
+            {
+                return pathname;
+            }
+            if (directory == "/")
+            {
+                throw std::runtime_error("No compilation database (compile_commands.json) found in the current directory or its parents.");
+            }
+            const auto i = directory.rfind('/');
+            directory = directory.substr(0, i == 0 ? 1 : i);
+        }
+    }
+
+    static std::string build_index(const std::string& database_pathname, const struct stat& database_status)
+    {
+        std::string error;
+        std::unique_ptr<clang::tooling::CompilationDatabase> database{clang::tooling::JSONCompilationDatabase::loadFromFile(database_pathname, error)};
+        if (not database)
+        {
+            throw std::runtime_error(error);
+        }
+
+        std::map<std::string /*canonical pathname*/, clang::tooling::CompileCommand> compile_commands;
+        for (const auto& file : database->getAllFiles())
+        {
+            const auto commands = database->getCompileCommands(file);
+            // XXX If there are multiple compile commands the first is used. It'd be nice to be able to pick which one, e.g. with a search string such as "-DDEBUG".
+            if (not commands.empty())
+            {
+                compile_commands.insert({canonical_pathname(file.c_str()), commands[0]});
+            }
+        }
+
+        std::vector<CompilationDatabaseIndexEntry> entries;
+        std::vector<uint32_t> argument_offsets;
+        std::string strings;
+        const auto add_string = [&strings](const std::string& s) { const uint32_t offset = strings.size(); strings += s; strings += '\0'; return offset; };
+        for (const auto& pathname_and_command : compile_commands)
+        {
+            const auto arguments = filter_compiler_arguments(pathname_and_command.second.CommandLine);
+            entries.push_back({add_string(pathname_and_command.first), add_string(pathname_and_command.second.Directory), uint32_t(argument_offsets.size()), uint32_t(arguments.size())});
+            for (const auto& argument : arguments)
+            {
+                argument_offsets.push_back(add_string(argument));
+            }
+        }
+
+        CompilationDatabaseIndexHeader header;
+        std::copy(compilation_database_index_magic, compilation_database_index_magic + sizeof(header.magic), header.magic);
+        header.json_modification_time = database_status.st_mtime;
+        header.json_size = database_status.st_size;
+        header.entry_count = entries.size();
+        header.argument_count = argument_offsets.size();
+
+        return std::string(reinterpret_cast<const char*>(&header), sizeof(header))
+             + std::string(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(entries[0]))
+             + std::string(reinterpret_cast<const char*>(argument_offsets.data()), argument_offsets.size() * sizeof(argument_offsets[0]))
+             + strings;
+    }
+
+    static bool write_file(const std::string& pathname, const std::string& contents) // (atomically, so that other processes never see a partially written file)
+    {
+        const auto temporary_pathname = pathname + ".tmp" + std::to_string(getpid());
+        std::ofstream out(temporary_pathname, std::ios::binary);
+        out.write(contents.data(), contents.size());
+        out.close();
+        if (not out or rename(temporary_pathname.c_str(), pathname.c_str()))
+        {
+            remove(temporary_pathname.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Returns whether every table and offset in the index lies within its size bytes (so that an index file that's been truncated or corrupted isn't used).
+    static bool is_valid_index(const char* data, size_t size)
+    {
+        if (size < sizeof(CompilationDatabaseIndexHeader)) { return false; }
+        const auto header = reinterpret_cast<const CompilationDatabaseIndexHeader*>(data);
+        const size_t tables_size = sizeof(CompilationDatabaseIndexHeader) + size_t(header->entry_count) * sizeof(CompilationDatabaseIndexEntry) + size_t(header->argument_count) * sizeof(uint32_t);
+        if (size <= tables_size or data[size-1] != '\0') { return false; }
+
+        const size_t strings_size = size - tables_size; // (Any offset less than this is the start of a null terminated string.)
+        const auto entries = reinterpret_cast<const CompilationDatabaseIndexEntry*>(header + 1);
+        const auto arguments = reinterpret_cast<const uint32_t*>(entries + header->entry_count);
+        for (uint32_t i = 0; i != header->entry_count; ++i)
+        {
+            if (entries[i].pathname_offset >= strings_size
+                or entries[i].directory_offset >= strings_size
+                or entries[i].first_argument > header->argument_count
+                or entries[i].argument_count > header->argument_count - entries[i].first_argument)
+            {
+                return false;
+            }
+        }
+        return std::all_of(arguments, arguments + header->argument_count, [strings_size](uint32_t offset) { return offset < strings_size; });
+    }
+
+    void set_index(const char* data, size_t size)
+    {
+        if (not is_valid_index(data, size))
+        {
+            throw std::runtime_error("Corrupt compilation database index.");
+        }
+        index_header = reinterpret_cast<const CompilationDatabaseIndexHeader*>(data);
+        index_entries = reinterpret_cast<const CompilationDatabaseIndexEntry*>(index_header + 1);
+        argument_offsets = reinterpret_cast<const uint32_t*>(index_entries + index_header->entry_count);
+        index_strings = reinterpret_cast<const char*>(argument_offsets + index_header->argument_count);
+    }
+
+    static bool is_index_up_to_date(const MappedFile& index, const struct stat& database_status)
+    {
+        const auto header = reinterpret_cast<const CompilationDatabaseIndexHeader*>(index.data());
+        return index.size() >= sizeof(*header)
+            and std::equal(compilation_database_index_magic, compilation_database_index_magic + sizeof(header->magic), header->magic)
+            and header->json_modification_time == database_status.st_mtime
+            and header->json_size == uint64_t(database_status.st_size);
+    }
+
+    const CompilationDatabaseIndexEntry* find_entry(const std::string& pathname) const
+    {
+        const auto i = lower_bound_by_string(index_entries, index_header->entry_count, index_strings,
+                [](const CompilationDatabaseIndexEntry& e) { return e.pathname_offset; }, pathname.c_str());
+        return (i != index_header->entry_count and pathname == index_strings + index_entries[i].pathname_offset)
+                ? &index_entries[i] : nullptr;
+    }
+
+    CompilationEnv get_environment(const CompilationDatabaseIndexEntry& entry) const
+    {
+        CompilationEnv env{index_strings + entry.pathname_offset, index_strings + entry.directory_offset, {}};
+        for (uint32_t i = entry.first_argument; i != entry.first_argument + entry.argument_count; ++i)
+        {
+            env.arguments.push_back(index_strings + argument_offsets[i]);
+        }
+        return env;
+    }
+
+    std::string header_map_pathname() const { return database_pathname + ".c++_context-headers"; }
+
+    // Returns whether every table and offset in the header map lies within its size bytes.
+    static bool is_valid_header_map(const char* data, size_t size)
+    {
+        if (size < sizeof(HeaderMapHeader)) { return false; }
+        const auto header = reinterpret_cast<const HeaderMapHeader*>(data);
+        const size_t tables_size = sizeof(HeaderMapHeader) + size_t(header->entry_count) * sizeof(HeaderMapEntry);
+        if (not std::equal(header_map_magic, header_map_magic + sizeof(header->magic), header->magic)
+            or size <= tables_size or data[size-1] != '\0')
+        {
+            return false;
+        }
+
+        const size_t strings_size = size - tables_size;
+        const auto entries = reinterpret_cast<const HeaderMapEntry*>(header + 1);
+        return std::all_of(entries, entries + header->entry_count,
+                [strings_size](const HeaderMapEntry& e) { return e.header_offset < strings_size and e.main_file_offset < strings_size; });
+    }
+
+    // Loads the header map if it hasn't already been loaded. Returns false if there isn't one (or it's corrupt - it's then rewritten by the next record_inclusions()). (header_map_mutex must be locked.)
+    bool load_header_map()
+    {
+        if (not mapped_header_map)
+        {
+            try
+            {
+                mapped_header_map.reset(new MappedFile(header_map_pathname().c_str()));
+            }
+            catch (const std::runtime_error&)
+            {
+                return false;
+            }
+            if (not is_valid_header_map(mapped_header_map->data(), mapped_header_map->size()))
+            {
+                mapped_header_map.reset();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Returns the header map entry for header_pathname, or null. (header_map_mutex must be locked.)
+    const HeaderMapEntry* find_header(const std::string& header_pathname)
+    {
+        if (not load_header_map()) { return nullptr; }
+
+        const auto header = reinterpret_cast<const HeaderMapHeader*>(mapped_header_map->data());
+        const auto entries = reinterpret_cast<const HeaderMapEntry*>(header + 1);
+        const auto strings = reinterpret_cast<const char*>(entries + header->entry_count);
+        const auto i = lower_bound_by_string(entries, header->entry_count, strings,
+                [](const HeaderMapEntry& e) { return e.header_offset; }, header_pathname.c_str());
+        return (i != header->entry_count and header_pathname == strings + entries[i].header_offset) ? &entries[i] : nullptr;
+    }
+
+    const char* header_map_strings() const
+    {
+        const auto header = reinterpret_cast<const HeaderMapHeader*>(mapped_header_map->data());
+        return reinterpret_cast<const char*>(reinterpret_cast<const HeaderMapEntry*>(header + 1) + header->entry_count);
+    }
+
+  public:
+    CompilationEnvironments()
+      : database_pathname{find_compilation_database()}
+    {
+        struct stat database_status;
+        if (stat(database_pathname.c_str(), &database_status))
+        {
+            throw std::runtime_error("Unable to stat " + database_pathname + ". " + strerror(errno));
+        }
+
+        const auto index_pathname = database_pathname + ".c++_context";
+        try
+        {
+            mapped_index.reset(new MappedFile(index_pathname.c_str()));
+            if (not is_index_up_to_date(*mapped_index, database_status)
+                or not is_valid_index(mapped_index->data(), mapped_index->size())) // (A corrupt index is rebuilt from compile_commands.json.)
+            {
+                mapped_index.reset();
+            }
+        }
+        catch (const std::runtime_error&) // (No index yet.)
+        {
+        }
+
+        if (not mapped_index)
+        {
+            unsaved_index = build_index(database_pathname, database_status);
+            if (write_file(index_pathname, unsaved_index))
+            {
+                mapped_index.reset(new MappedFile(index_pathname.c_str()));
+                unsaved_index.clear();
+            }
+        }
+
+        if (mapped_index)
+            set_index(mapped_index->data(), mapped_index->size());
+        else
+            set_index(unsaved_index.data(), unsaved_index.size());
+    }
+
+    CompilationEnvironments(const CompilationEnvironments&) = delete;
+    CompilationEnvironments& operator=(const CompilationEnvironments&) = delete;
+
+    std::vector<std::string> get_all_source_files() const
+    {
+        std::vector<std::string> files;
+        for (uint32_t i = 0; i != index_header->entry_count; ++i)
+        {
+            files.push_back(index_strings + index_entries[i].pathname_offset);
+        }
+        return files;
+    }
+
+    CompilationEnv get_compile_environment(const std::string& file_path)
+    {
+        const auto pathname = canonical_pathname(file_path.c_str());
+        if (const auto entry = find_entry(pathname))
+        {
+            return get_environment(*entry);
+        }
+
+        std::lock_guard<std::mutex> lock(header_map_mutex);
+        if (const auto header_map_entry = find_header(pathname))
+        {
+            if (const auto entry = find_entry(header_map_strings() + header_map_entry->main_file_offset))
+            {
+                return get_environment(*entry);
+            }
+        }
+        throw std::runtime_error("No compilation environment known for " + file_path);
+    }
+
+    // Records the files included by main_file's translation unit, so that the headers among them can later be parsed via main_file.
+    void record_inclusions(const std::string& main_file, const std::vector<std::string>& file_names)
+    {
+        record_inclusions({{main_file, file_names}});
+    }
+
+    void record_inclusions(const std::vector<std::pair<std::string /*main file*/, std::vector<std::string> /*file names*/>>& translation_units)
+    {
+        std::lock_guard<std::mutex> lock(header_map_mutex);
+
+        std::map<std::string /*header*/, std::pair<std::string /*main file*/, uint32_t /*file count*/>> changes;
+        for (const auto& translation_unit : translation_units)
+        {
+            const uint32_t file_count = translation_unit.second.size();
+            for (const auto& file_name : translation_unit.second)
+            {
+                const auto header = canonical_pathname(file_name.c_str());
+                if (header == translation_unit.first or find_entry(header)) { continue; } // (Files with their own compile command don't need the header map.)
+
+                const auto existing = find_header(header);
+                auto change = changes.find(header);
+                if ((not existing or file_count < existing->main_file_file_count)
+                    and (change == changes.end() or file_count < change->second.second))
+                {
+                    changes[header] = {translation_unit.first, file_count};
+                }
+            }
+        }
+        if (changes.empty()) { return; }
+
+        std::map<std::string, std::pair<std::string, uint32_t>> header_map;
+        if (load_header_map())
+        {
+            const auto header = reinterpret_cast<const HeaderMapHeader*>(mapped_header_map->data());
+            const auto entries = reinterpret_cast<const HeaderMapEntry*>(header + 1);
+            const auto strings = header_map_strings();
+            for (uint32_t i = 0; i != header->entry_count; ++i)
+            {
+                header_map[strings + entries[i].header_offset] = {strings + entries[i].main_file_offset, entries[i].main_file_file_count};
+            }
+        }
+        for (const auto& change : changes)
+        {
+            header_map[change.first] = change.second;
+        }
+
+        std::vector<HeaderMapEntry> entries;
+        std::string strings;
+        const auto add_string = [&strings](const std::string& s) { const uint32_t offset = strings.size(); strings += s; strings += '\0'; return offset; };
+        for (const auto& header_and_main_file : header_map)
+        {
+            entries.push_back({add_string(header_and_main_file.first), add_string(header_and_main_file.second.first), header_and_main_file.second.second});
+        }
+        HeaderMapHeader header;
+        std::copy(header_map_magic, header_map_magic + sizeof(header.magic), header.magic);
+        header.entry_count = entries.size();
+        header.reserved = 0;
+
+        // XXX Only threads of this process are serialized (by header_map_mutex). If another c++_context process records inclusions between this process loading the header map and writing it, the other process's changes are lost. (The write is atomic, so the file is never corrupted - it's just missing entries, which are recorded again when those source files are next parsed.) Fixing this needs a file lock around the whole read-modify-write, or a re-read and merge just before the rename.
+        mapped_header_map.reset();
+        write_file(header_map_pathname(),
+                   std::string(reinterpret_cast<const char*>(&header), sizeof(header))
+                   + std::string(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(entries[0]))
+                   + strings);
+    }
+};
+
+
+void change_directory(const char* path)
+{
+    if (chdir(path))
+    {
+        throw std::runtime_error(std::string("chdir failed. ") + strerror(errno));
+    }
+}
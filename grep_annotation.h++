@@ -0,0 +1,367 @@
+// Annotation of the output of grep (or ripgrep) with the context of each match.
+
+#pragma once
+
+#include "approximate_context.h++"
+#include "compilation_environments.h++"
+#include "libclang++.h++"
+#include "mapped_file.h++"
+#include <algorithm> // min, sort
+#include <cctype> // isdigit
+#include <condition_variable>
+#include <cstdlib> // strtoull
+#include <cstring> // memchr, strlen
+#include <deque>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility> // pair
+#include <vector>
+
+
+struct SearchResultLine
+{
+    std::string text; // (The line as it's to be output, less the context.)
+    bool is_match; // false for lines that are just passed through, e.g. grep's "--" context separators.
+    std::string pathname;
+    size_t line_number; // (one-based) Only used if line_offset is unknown.
+    size_t line_offset; // (zero-based byte offset of the start of the line) or unknown_offset.
+
+    static const size_t unknown_offset = size_t(-1);
+};
+const size_t SearchResultLine::unknown_offset;
+
+
+// Parses a JSON string starting at s[i] (the opening quote). Returns false if there isn't a valid string.
+bool parse_json_string(const std::string& s, size_t i, std::string& result)
+{
+    if (i >= s.length() or s[i] != '"') { return false; }
+
+    const auto append_utf8 = [&result](unsigned long c)
+    {
+        if (c < 0x80) { result += char(c); }
+        else if (c < 0x800) { result += char(0xc0 | c >> 6); result += char(0x80 | (c & 0x3f)); }
+        else if (c < 0x10000) { result += char(0xe0 | c >> 12); result += char(0x80 | (c >> 6 & 0x3f)); result += char(0x80 | (c & 0x3f)); }
+        else { result += char(0xf0 | c >> 18); result += char(0x80 | (c >> 12 & 0x3f)); result += char(0x80 | (c >> 6 & 0x3f)); result += char(0x80 | (c & 0x3f)); }
+    };
+    const auto parse_hex4 = [&s](size_t j, unsigned long& c)
+    {
+        if (j + 4 > s.length()) { return false; }
+        std::istringstream iss(s.substr(j, 4));
+        return bool(iss >> std::hex >> c);
+    };
+
+    for (++i; i < s.length(); ++i)
+    {
+        if (s[i] == '"') { return true; }
+        if (s[i] != '\\') { result += s[i]; continue; }
+
+        if (++i == s.length()) { return false; }
+        switch (s[i])
+        {
+            case 'b': result += '\b'; break;
+            case 'f': result += '\f'; break;
+            case 'n': result += '\n'; break;
+            case 'r': result += '\r'; break;
+            case 't': result += '\t'; break;
+            case 'u':
+            {
+                unsigned long c;
+                if (not parse_hex4(i+1, c)) { return false; }
+                i += 4;
+                unsigned long low_surrogate;
+                if (c >= 0xd800 and c < 0xdc00
+                    and i + 2 < s.length() and s[i+1] == '\\' and s[i+2] == 'u' and parse_hex4(i+3, low_surrogate))
+                {
+                    c = 0x10000 + ((c - 0xd800) << 10) + (low_surrogate - 0xdc00);
+                    i += 6;
+                }
+                append_utf8(c);
+                break;
+            }
+            default: result += s[i]; // (", \ and /)
+        }
+    }
+    return false;
+}
+
+
+// Parses a line of "rg --json" output. Only "match" messages are matches; other messages are output as empty lines (which are dropped).
+SearchResultLine parse_ripgrep_json_line(const std::string& line)
+{
+    SearchResultLine result{"", false, "", 0, SearchResultLine::unknown_offset};
+    if (line.find("\"type\":\"match\"") == std::string::npos) { return result; }
+
+    // (Keys can't appear inside JSON string values as the quotes would be escaped.)
+    const auto value_position = [&line](const char* key) { const auto i = line.find(key); return i == std::string::npos ? i : i + strlen(key); };
+
+    std::string text;
+    std::istringstream line_number(line.substr(std::min(line.length(), value_position("\"line_number\":"))));
+    std::istringstream absolute_offset(line.substr(std::min(line.length(), value_position("\"absolute_offset\":"))));
+    if (parse_json_string(line, value_position("\"path\":{\"text\":"), result.pathname)
+        and parse_json_string(line, value_position("\"lines\":{\"text\":"), text)
+        and line_number >> result.line_number
+        and absolute_offset >> result.line_offset)
+    {
+        result.is_match = true;
+        while (not text.empty() and (text.back() == '\n' or text.back() == '\r')) { text.pop_back(); }
+        result.text = result.pathname + ':' + std::to_string(result.line_number) + ':' + text;
+    }
+    else
+    {
+        result.pathname.clear();
+        result.line_offset = SearchResultLine::unknown_offset;
+    }
+    return result;
+}
+
+
+// Parses a line of "grep -n" (pathname:line_number:text) or "grep -b" (pathname:byte_offset:text) output. Context lines (pathname-line_number-text, from grep's -A, -B and -C options) aren't matches.
+// XXX Matches in files whose pathnames contain "-digits-" are taken to be context lines. (grep's output is ambiguous.)
+SearchResultLine parse_grep_line(const std::string& line, bool has_byte_offsets)
+{
+    SearchResultLine result{line, false, "", 0, SearchResultLine::unknown_offset};
+
+    // (Pathnames can contain ':' and '-', so look for the first ":digits:" or "-digits-".)
+    for (auto i = line.find_first_of(":-"); i != std::string::npos; i = line.find_first_of(":-", i+1))
+    {
+        auto j = i + 1;
+        while (j < line.length() and isdigit(static_cast<unsigned char>(line[j]))) { ++j; }
+        if (j > i + 1 and j < line.length() and line[j] == line[i])
+        {
+            if (line[i] == ':')
+            {
+                const size_t number = strtoull(line.c_str() + i + 1, /*endptr*/ NULL, 10);
+                result.is_match = true;
+                result.pathname = line.substr(0, i);
+                (has_byte_offsets ? result.line_offset : result.line_number) = number;
+            }
+            break;
+        }
+    }
+    return result;
+}
+
+
+std::vector<size_t> get_line_offsets(const MappedFile& file) // (zero-based offset of the start of each line)
+{
+    std::vector<size_t> line_offsets {0};
+    for (const char* p = file.data(), * const end = file.data() + file.size();
+         p != end and (p = static_cast<const char*>(memchr(p, '\n', end - p)));
+         ++p)
+    {
+        line_offsets.push_back(p + 1 - file.data());
+    }
+    return line_offsets;
+}
+
+
+struct SearchResultFile // consecutive lines of search results for one file
+{
+    std::string pathname;
+    std::vector<SearchResultLine> lines;
+    std::unique_ptr<CompilationEnv> compilation_environment; // (null if not known)
+    std::string error;
+};
+
+
+// Returns the lines of search_result_file, each match preceded by its context, e.g. "[namespace N / S::doit()] s.c++:42:    x = 1;".
+// If approximate, contexts are found by the approximate lexical scan (and end with "(approximate)").
+std::string annotate(const SearchResultFile& search_result_file, bool approximate)
+{
+    std::vector<std::string> contexts(search_result_file.lines.size());
+    std::string error = search_result_file.error;
+
+    if (search_result_file.compilation_environment or approximate)
+    {
+        try
+        {
+            const MappedFile file(search_result_file.pathname.c_str());
+            const auto line_offsets = get_line_offsets(file);
+
+            std::vector<std::pair<size_t /*query offset*/, size_t /*line index*/>> queries;
+            for (size_t i = 0; i != search_result_file.lines.size(); ++i)
+            {
+                const auto& line = search_result_file.lines[i];
+                if (not line.is_match) { continue; }
+
+                size_t offset = line.line_offset;
+                if (offset == SearchResultLine::unknown_offset)
+                {
+                    if (line.line_number == 0 or line.line_number > line_offsets.size()) { continue; }
+                    offset = line_offsets[line.line_number - 1];
+                }
+                while (offset < file.size() and (file.data()[offset] == ' ' or file.data()[offset] == '\t')) { ++offset; } // (Query the first non-blank character.)
+                queries.push_back({offset, i});
+            }
+            std::sort(queries.begin(), queries.end());
+
+            std::vector<size_t> sorted_query_offsets;
+            for (const auto& query : queries) { sorted_query_offsets.push_back(query.first); }
+
+            if (approximate)
+            {
+                const auto query_contexts = get_approximate_contexts(file.data(), file.size(), sorted_query_offsets);
+                for (size_t i = 0; i != queries.size(); ++i)
+                {
+                    contexts[queries[i].second] = query_contexts[i] + approximate_context_label;
+                }
+            }
+            else
+            {
+                Libclang::TranslationUnitContext translation_unit_context(/*exclude_declarations_from_PCH*/ true, /*display_diagnostics*/ false);
+                const auto& compilation_environment = *search_result_file.compilation_environment;
+                Libclang::TranslationUnit translation_unit(translation_unit_context, compilation_environment.main_file.c_str(),
+                        get_environment_arguments_with_working_directory(compilation_environment),
+                        /*unsaved_files*/ {},
+                        /*options*/ CXTranslationUnit_None);
+                const auto query_contexts = get_contexts(translation_unit, sorted_query_offsets,
+                        get_query_file(translation_unit, compilation_environment, search_result_file.pathname));
+                for (size_t i = 0; i != queries.size(); ++i)
+                {
+                    contexts[queries[i].second] = query_contexts[i];
+                }
+            }
+        }
+        catch (const std::exception& e)
+        {
+            error = e.what();
+        }
+    }
+
+    std::string result;
+    if (not error.empty())
+    {
+        result += "[ERROR: " + error + "]\n";
+    }
+    for (size_t i = 0; i != search_result_file.lines.size(); ++i)
+    {
+        const auto& line = search_result_file.lines[i];
+        if (line.is_match)
+        {
+            std::string context;
+            for (const char c : contexts[i])
+            {
+                context += (c == '\n') ? " / " : std::string(1, c);
+            }
+            result += '[' + context.substr(0, context.length() - std::min<size_t>(context.length(), 3) /*(trailing " / ")*/) + "] ";
+        }
+        if (not line.is_match and line.text.empty()) { continue; } // (e.g. rg's "begin" and "end" messages)
+        result += line.text + '\n';
+    }
+    return result;
+}
+
+
+// Reads the output of "grep -n" (or "grep -b" if has_byte_offsets), or "rg --json", from search_results and writes each line to output, preceded by its context.
+// If compilation_environments is null, contexts are found by the approximate lexical scan (see approximate_context.h++) instead of by parsing.
+// Consecutive lines for the same file are annotated together (with the file being parsed once) on a separate thread; at most max_files_in_flight files are annotated (or waiting to be written) at a time. Output order is the same as the input order.
+// Annotated files are written by a writer thread as soon as they (and the files before them) are done, even while no more search results are arriving (e.g. while grep searches a large directory tree).
+// XXX A file is parsed more than once if its search results aren't consecutive. (grep and rg output each file's results consecutively.)
+void annotate_search_results(CompilationEnvironments* compilation_environments /*null for approximate contexts*/, std::istream& search_results, std::ostream& output, bool has_byte_offsets, size_t max_files_in_flight)
+{
+    if (max_files_in_flight == 0) { max_files_in_flight = 1; }
+
+    std::mutex mutex; // (for the following)
+    std::condition_variable changed;
+    std::deque<std::future<std::string>> files_in_flight; // (not yet taken by the writer)
+    size_t unwritten_file_count = 0;
+    bool is_input_finished = false;
+
+    std::thread writer([&]()
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (true)
+                {
+                    changed.wait(lock, [&]() { return not files_in_flight.empty() or is_input_finished; });
+                    if (files_in_flight.empty()) { return; }
+                    auto file = std::move(files_in_flight.front());
+                    files_in_flight.pop_front();
+                    lock.unlock();
+                    try
+                    {
+                        output << file.get() << std::flush;
+                    }
+                    catch (const std::exception& e)
+                    {
+                        output << "[ERROR: " << e.what() << "]\n" << std::flush;
+                    }
+                    lock.lock();
+                    --unwritten_file_count;
+                    changed.notify_all();
+                }
+            });
+    const auto finish_writing = [&]()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            is_input_finished = true;
+        }
+        changed.notify_all();
+        writer.join();
+    };
+
+    std::unique_ptr<SearchResultFile> current_file;
+    const auto start_annotating_current_file = [&]()
+    {
+        if (not current_file) { return; }
+        std::shared_ptr<SearchResultFile> file{std::move(current_file)};
+        const bool approximate = not compilation_environments;
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]() { return unwritten_file_count < max_files_in_flight; });
+        ++unwritten_file_count;
+        files_in_flight.push_back(std::async(std::launch::async, [file, approximate]() { return annotate(*file, approximate); }));
+        changed.notify_all();
+    };
+
+    try
+    {
+        for (std::string line; std::getline(search_results, line); )
+        {
+            auto search_result_line = (not line.empty() and line[0] == '{') ? parse_ripgrep_json_line(line)
+                                                                            : parse_grep_line(line, has_byte_offsets);
+            if (search_result_line.is_match)
+            {
+                search_result_line.pathname = canonical_pathname(search_result_line.pathname.c_str());
+            }
+
+            if (search_result_line.is_match and (not current_file or current_file->pathname != search_result_line.pathname))
+            {
+                start_annotating_current_file();
+                current_file.reset(new SearchResultFile{search_result_line.pathname, {}, nullptr, ""});
+                try
+                {
+                    if (compilation_environments)
+                    {
+                        current_file->compilation_environment.reset(new CompilationEnv(compilation_environments->get_compile_environment(search_result_line.pathname)));
+                    }
+                }
+                catch (const std::exception& e)
+                {
+                    current_file->error = e.what();
+                }
+            }
+
+            if (current_file)
+            {
+                current_file->lines.push_back(search_result_line);
+            }
+            else if (not search_result_line.text.empty()) // (Lines before the first match. The writer has nothing to write yet.)
+            {
+                output << search_result_line.text << '\n';
+            }
+        }
+        start_annotating_current_file();
+    }
+    catch (...)
+    {
+        finish_writing();
+        throw;
+    }
+    finish_writing();
+}
@@ -5,6 +5,7 @@
 #include <clang-c/Index.h>
 #include <cstring> // strlen
 #include <stdexcept>
+#include <string>
 #include <vector>
 
 
@@ -76,6 +77,17 @@ namespace Libclang
             }
         }
 
+        TranslationUnit(
+                TranslationUnitContext& translation_unit_context,
+                const char *ast_filename /*as written by save()*/)
+          : translation_unit{clang_createTranslationUnit(translation_unit_context, ast_filename)}
+        {
+            if (!translation_unit)
+            {
+                throw std::runtime_error("clang_createTranslationUnit() failed.");
+            }
+        }
+
         ~TranslationUnit()
         {
             clang_disposeTranslationUnit(translation_unit);
@@ -86,6 +98,25 @@ namespace Libclang
 
         operator CXTranslationUnit() { return translation_unit; }
 
+        void reparse(/*const*/ std::vector<UnsavedFile> unsaved_files)
+        {
+            if (clang_reparseTranslationUnit(translation_unit,
+                        unsaved_files.size(), unsaved_files.data(),
+                        clang_defaultReparseOptions(translation_unit)))
+            {
+                // (The translation unit must now be disposed; it can't be used again.)
+                throw std::runtime_error("clang_reparseTranslationUnit() failed.");
+            }
+        }
+
+        void save(const char* ast_filename)
+        {
+            if (clang_saveTranslationUnit(translation_unit, ast_filename, clang_defaultSaveOptions(translation_unit)) != CXSaveError_None)
+            {
+                throw std::runtime_error("clang_saveTranslationUnit() failed.");
+            }
+        }
+
         CXCursor get_cursor() const
         {
             return clang_getTranslationUnitCursor(translation_unit);
@@ -127,6 +158,31 @@ namespace Libclang
     }
 
 
+    template<typename T_Function>
+    void visit_inclusions(CXTranslationUnit translation_unit, T_Function function) // function is called for each file in the translation unit (including the main file)
+    {
+        clang_getInclusions(translation_unit,
+            [](CXFile included_file, CXSourceLocation* /*inclusion_stack*/, unsigned /*include_len*/, CXClientData visit_fn_)
+            {
+                const T_Function& visit_fn = *static_cast<T_Function*>(visit_fn_);
+                visit_fn(included_file);
+            },
+            &function);
+    }
+
+
+    std::vector<std::string> get_file_names(CXTranslationUnit translation_unit) // (of the main file and every file it includes)
+    {
+        std::vector<std::string> file_names;
+        visit_inclusions(translation_unit,
+                [&file_names](CXFile file)
+                {
+                    file_names.push_back(static_cast<const char*>(String{clang_getFileName(file)}));
+                });
+        return file_names;
+    }
+
+
     String get_display_name(const CXCursor& cursor)
     {
         return clang_getCursorDisplayName(cursor);
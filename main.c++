@@ -2,131 +2,394 @@
 // XXX command line arguments and looking up a "compilation database".
 // XXX See http://clang.llvm.org/docs/LibTooling.html
 
+#include "approximate_context.h++"
+#include "ast_cache.h++"
+#include "compilation_environments.h++"
+#include "grep_annotation.h++"
 #include "libclang++.h++"
-#include <clang/Tooling/CompilationDatabase.h>
-#include <algorithm> // find
-#include <cstring> // strerror
+#include "mapped_file.h++"
+#include "scope_index.h++"
+#include "stats.h++"
+#include "translation_unit_cache.h++"
+#include <algorithm> // find, replace, stable_sort
+#include <fstream>
+#include <functional>
+#include <initializer_list>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
 #include <string>
-#include <unistd.h> // chdir
+#include <thread> // hardware_concurrency
 #include <vector>
 
 
-using CompilationEnv = clang::tooling::CompileCommand;
+// pathname must be canonical (see canonical_pathname()), as the current directory is changed.
+std::vector<std::string> get_contexts(CompilationEnvironments& compilation_environments, const AstCache* ast_cache /*may be null*/, Stats* stats /*may be null*/, const char* pathname, const std::vector<size_t>& sorted_query_offsets)
+{
+    const auto compilation_environment = [&]() { Stats::Timer timer(stats, "find compile command"); return compilation_environments.get_compile_environment(pathname); }();
+    // Check compiler used?  if (not is_clang(compilation_environment.CommandLine[0])) { XXX }
+    change_directory(compilation_environment.directory);
 
+    Libclang::TranslationUnitContext translation_unit_context;
+    std::unique_ptr<Libclang::TranslationUnit> translation_unit;
+    if (ast_cache)
+    {
+        Stats::Timer timer(stats, "load AST");
+        translation_unit = ast_cache->load(translation_unit_context, compilation_environment);
+    }
+    if (not translation_unit)
+    {
+        {
+            Stats::Timer timer(stats, "parse");
+            translation_unit.reset(new Libclang::TranslationUnit(translation_unit_context, compilation_environment.main_file.c_str(),
+                    get_environment_arguments(compilation_environment),
+                    /*unsaved_files*/ {},
+                    /*options*/ ast_cache ? CXTranslationUnit_ForSerialization : CXTranslationUnit_None));
+        }
+        {
+            Stats::Timer timer(stats, "record inclusions");
+            compilation_environments.record_inclusions(compilation_environment.main_file, Libclang::get_file_names(*translation_unit));
+        }
+        if (ast_cache)
+        {
+            Stats::Timer timer(stats, "save AST");
+            ast_cache->save(*translation_unit, compilation_environment);
+        }
+    }
 
-std::string file_extension(const std::string& s)
+//    if (clang_getNumDiagnostics(*translation_unit)) {}
+    Stats::Timer timer(stats, "query");
+    return get_contexts(*translation_unit, sorted_query_offsets, get_query_file(*translation_unit, compilation_environment, pathname));
+}
+
+
+// Returns the approximate contexts (see approximate_context.h++) of sorted_query_offsets in the file at pathname, each labelled as approximate.
+std::vector<std::string> get_approximate_contexts(Stats* stats /*may be null*/, const char* pathname, const std::vector<size_t>& sorted_query_offsets)
 {
-    const auto i = s.rfind('.');
-    return (i == std::string::npos) ? "" : s.substr(i+1);
+    Stats::Timer timer(stats, "approximate scan");
+    const MappedFile file(pathname);
+    auto contexts = get_approximate_contexts(file.data(), file.size(), sorted_query_offsets);
+    for (auto& context : contexts)
+    {
+        context += approximate_context_label;
+    }
+    return contexts;
+}
+
+
+std::unique_ptr<CompilationEnvironments> load_compilation_environments(Stats* stats /*may be null*/)
+{
+    Stats::Timer timer(stats, "load compilation db");
+    return std::unique_ptr<CompilationEnvironments>{new CompilationEnvironments};
 }
 
-bool has_cpp_source_file_extension(const std::string& s)
+
+// Returns the context of each of sorted_query_offsets in the file at pathname (canonical - see canonical_pathname()), by parsing with libclang or by the approximate lexical scan (see main()).
+using GetContextsFn = std::function<std::vector<std::string>(const char* pathname, const std::vector<size_t>& sorted_query_offsets)>;
+
+
+void output_context(const GetContextsFn& get_file_contexts, const char* pathname, const size_t query_offset)
 {
-    static const std::vector<std::string> cpp_source_file_extensions {"cpp", "c++", "cxx", "cc", "C", "c"};
-    return std::find(cpp_source_file_extensions.begin(), cpp_source_file_extensions.end(), file_extension(s))
-                    != cpp_source_file_extensions.end();
+    std::cout << get_file_contexts(canonical_pathname(pathname).c_str(), {query_offset}).front();
 }
 
 
-std::vector<const char*> get_environment_arguments(const CompilationEnv& env)
+struct Query
 {
-    std::vector<const char*> args;
+    std::string pathname;
+    size_t offset;
+};
+
+bool parse_query(const std::string& line, Query& query) // line is "pathname zero-based_offset"
+{
+    const auto i = line.find_last_of(" \t");
+    if (i == std::string::npos) { return false; }
+
+    std::istringstream iss(line.substr(i+1));
+    query.pathname = line.substr(0, line.find_last_not_of(" \t", i) + 1);
+    return not query.pathname.empty() and (iss >> query.offset) and (iss >> std::ws).eof();
+}
+
 
-    for (auto arg_it = env.CommandLine.begin() + 1 /*skip compiler*/;
-         arg_it != env.CommandLine.end();
-         ++arg_it)
+// Outputs the context for each query read from query_stream. Each translation unit is parsed only once, however many queries there are for it. Output is in query order; each query line is echoed, followed by its context (or, if its file couldn't be parsed, a line "error: message") and a blank line.
+// Returns 1 if any query failed.
+int output_contexts(const GetContextsFn& get_file_contexts, std::istream& query_stream)
+{
+    std::vector<Query> queries;
+    for (std::string line; std::getline(query_stream, line); )
     {
-        // Filter out the source filename as we ultimately pass the source filename via a separate argument to clang_parseTranslationUnit, otherwise it won't create the translation unit.
-        if ("-c" == *arg_it or "-o" == *arg_it)
+        if (line.find_first_not_of(" \t") == std::string::npos) { continue; }
+
+        Query query;
+        if (not parse_query(line, query))
         {
-            ++arg_it;
+            std::cerr << "Invalid query: " << line << "\n";
+            return 2;
+        }
+        queries.push_back(query);
+    }
+
+    std::map<std::string /*canonical pathname*/, std::vector<size_t /*query index*/>> query_indexes_by_pathname; // (Pathnames are made canonical before any query changes the current directory.)
+    for (size_t i = 0; i != queries.size(); ++i)
+    {
+        query_indexes_by_pathname[canonical_pathname(queries[i].pathname.c_str())].push_back(i);
+    }
+
+    std::vector<std::string> contexts(queries.size());
+    bool has_failed_query = false;
+    for (auto& pathname_and_query_indexes : query_indexes_by_pathname)
+    {
+        auto& query_indexes = pathname_and_query_indexes.second;
+        std::stable_sort(query_indexes.begin(), query_indexes.end(),
+                [&queries](size_t a, size_t b) { return queries[a].offset < queries[b].offset; });
+
+        std::vector<size_t> sorted_query_offsets;
+        for (const auto i : query_indexes) { sorted_query_offsets.push_back(queries[i].offset); }
+
+        try
+        {
+            const auto file_contexts = get_file_contexts(pathname_and_query_indexes.first.c_str(), sorted_query_offsets);
+            for (size_t i = 0; i != query_indexes.size(); ++i)
+            {
+                contexts[query_indexes[i]] = file_contexts[i];
+            }
         }
-        else if (not ((*arg_it)[0] != '-' and has_cpp_source_file_extension(*arg_it)) /*XXX <- A hack (?) to check if arg isn't source file to compile and link - should probably use clang::tooling::CommonOptionsParser::getSourcePathList() */)
+        catch (const std::exception& e)
         {
-            args.push_back(arg_it->c_str());
-            if ("-include" == *arg_it)
+            std::cerr << pathname_and_query_indexes.first << ": " << e.what() << "\n";
+            std::string error = std::string("error: ") + e.what();
+            std::replace(error.begin(), error.end(), '\n', ' ');
+            for (const auto i : query_indexes)
             {
-                args.push_back((++arg_it /*XXX*/)->c_str()); // (Ensure include files aren't filtered out.)
+                contexts[i] = error + "\n"; // (An empty context would look like an answer at global scope.)
             }
+            has_failed_query = true;
         }
     }
-    return args;
+
+    for (size_t i = 0; i != queries.size(); ++i)
+    {
+        std::cout << queries[i].pathname << " " << queries[i].offset << "\n" << contexts[i] << "\n";
+    }
+    return has_failed_query ? 1 : 0;
 }
 
 
-class CompilationEnvironments
+// Answers requests read from request_stream until end-of-file, keeping recently used translation units parsed between requests.
+// A request is a line "zero-based_offset unsaved_contents_length pathname" followed by unsaved_contents_length bytes of unsaved file contents to use instead of the contents of pathname on disk (if unsaved_contents_length is 0 the file on disk is used).
+// Each response is a status line, "ok" or "error: message", followed by the context (empty after an error) and a blank line. If approximate, contexts are found by the approximate lexical scan (and nothing is parsed).
+int serve(std::istream& request_stream, std::ostream& response_stream, bool approximate)
 {
-    clang::tooling::CompilationDatabase* p_compilation_database{nullptr};
-  public:
-    ~CompilationEnvironments()
-    {
-        if (p_compilation_database)
-            delete p_compilation_database;
-    }
-    CompilationEnvironments()
+    std::unique_ptr<CompilationEnvironments> compilation_environments; // (created when first needed)
+    std::unique_ptr<TranslationUnitCache> translation_units;
+    const auto working_directory = canonical_pathname("."); // (Relative pathnames are relative to this, although parsing changes the current directory.)
+
+    for (std::string request_line; std::getline(request_stream, request_line); )
     {
-        std::string error;
-        p_compilation_database = clang::tooling::CompilationDatabase::autoDetectFromDirectory(/*SourceDir*/ ".", error);
-        if (error.length())
+        size_t query_offset, unsaved_contents_length;
+        std::string pathname;
+        std::istringstream iss(request_line);
+        if (not (iss >> query_offset >> unsaved_contents_length) or not std::getline(iss >> std::ws, pathname))
         {
-            throw std::runtime_error(error);
+            std::cerr << "Invalid request: " << request_line << "\n";
+            return 2;
         }
-    }
-
-    CompilationEnvironments(const CompilationEnvironments&) = delete;
-    CompilationEnvironments& operator=(const CompilationEnvironments&) = delete;
 
-    CompilationEnv get_compile_environment(llvm::StringRef file_path)
-    {
-        auto compilation_commands = p_compilation_database->getCompileCommands(file_path);
-        if (compilation_commands.size() == 0)
+        std::string unsaved_contents(unsaved_contents_length, '\0');
+        if (not request_stream.read(&unsaved_contents[0], unsaved_contents_length))
         {
-            throw std::runtime_error("No compilation environment known for " + std::string(file_path));
+            std::cerr << "Unexpected end of unsaved contents for " << pathname << "\n";
+            return 2;
         }
 
-        if (compilation_commands.size() > 1)
+        std::string status = "ok", context;
+        try
         {
-            // XXX maybe some of the vector elements are "equivalent" - remove "redundant" elements, e.g. for an include file that is included multiple times with the same macros, search paths, etc.
-            // XXX need to be able to pick which one to use if there are still multiple after filtering "redundant" elements. Perhaps a search string could be provided, e.g. "-DDEBUG", which would hopefully filter out just one match.
+            const auto canonical = canonical_pathname(pathname, working_directory);
+            if (approximate)
+            {
+                const std::unique_ptr<MappedFile> file{unsaved_contents_length ? nullptr : new MappedFile(canonical.c_str())};
+                context = (file ? get_approximate_context(file->data(), file->size(), query_offset)
+                                : get_approximate_context(unsaved_contents.data(), unsaved_contents_length, query_offset))
+                          + approximate_context_label;
+            }
+            else
+            {
+                if (not translation_units)
+                {
+                    compilation_environments.reset(new CompilationEnvironments);
+                    translation_units.reset(new TranslationUnitCache(/*capacity*/ 8, *compilation_environments));
+                }
+                context = translation_units->get_context(canonical, query_offset, unsaved_contents_length ? &unsaved_contents : nullptr);
+            }
         }
-
-        return compilation_commands[0];
+        catch (const std::exception& e)
+        {
+            status = std::string("error: ") + e.what();
+            std::replace(status.begin(), status.end(), '\n', ' '); // (The status is one line.)
+        }
+        response_stream << status << "\n" << context << "\n" << std::flush;
     }
-};
+    return 0;
+}
 
 
-void change_directory(const char* path)
+int main(int argc, char* argv[])
 {
-    if (chdir(path))
+    const char* usage_message = "Usage: [--cache-dir=directory] [--stats] [--approximate] pathname zero-based_offset\n"
+                                "       [--cache-dir=directory] [--stats] [--approximate] --batch [queries_pathname]   (Reads \"pathname zero-based_offset\" lines from queries_pathname, or from stdin.)\n"
+                                "       [--approximate] --server   (Answers requests read from stdin until end-of-file. See serve().)\n"
+                                "       [--stats] --index [-jthread_count] index_pathname   (Indexes the scopes of every file of every translation unit in the compilation database.)\n"
+                                "       [--approximate] --annotate [--bytes]   (Reads \"grep -n\" (or \"grep -b\" with --bytes) or \"rg --json\" output from stdin and outputs each line preceded by its context.)\n"
+                                "       --lookup index_pathname pathname zero-based_offset   (Outputs the context using an index written by --index.)\n"
+                                "--cache-dir keeps parsed translation units in directory for use by later runs.\n"
+                                "--stats outputs (to stderr) the wall time, CPU time and peak resident set size of each phase, and the number of AST cursors visited (and of queries that fell back to the full walk).\n"
+                                "--approximate finds contexts by a lexical scan of the file, without parsing (or needing a compilation database). It's much faster, but may be wrong; each context's last line is \"(approximate)\".\n";
+
+    const char* cache_directory = nullptr;
+    std::unique_ptr<Stats> stats;
+    bool approximate = false;
+    const std::string cache_dir_option = "--cache-dir=";
+    for (; argc >= 1+1; --argc, ++argv)
     {
-        throw std::runtime_error(std::string("chdir failed. ") + strerror(errno));
+        if (std::string(argv[1]).compare(0, cache_dir_option.length(), cache_dir_option) == 0)
+        {
+            cache_directory = argv[1] + cache_dir_option.length();
+        }
+        else if (argv[1] == std::string("--stats"))
+        {
+            stats.reset(new Stats);
+        }
+        else if (argv[1] == std::string("--approximate"))
+        {
+            approximate = true;
+        }
+        else
+        {
+            break;
+        }
     }
-}
 
+    // (Options that a mode would ignore are rejected.)
+    const std::string mode = argc >= 1+1 ? argv[1] : "";
+    const auto is_mode_one_of = [&mode](std::initializer_list<const char*> modes) { return std::find(modes.begin(), modes.end(), mode) != modes.end(); };
+    const char* const ignored_option = (cache_directory and is_mode_one_of({"--server", "--index", "--annotate", "--lookup"})) ? "--cache-dir"
+                                     : (stats and is_mode_one_of({"--server", "--annotate", "--lookup"})) ? "--stats"
+                                     : (approximate and is_mode_one_of({"--index", "--lookup"})) ? "--approximate"
+                                     : nullptr;
+    if (ignored_option)
+    {
+        std::cerr << ignored_option << " can't be used with " << mode << ".\n" << usage_message;
+        return 1;
+    }
+    const std::unique_ptr<AstCache> ast_cache{cache_directory ? new AstCache(cache_directory) : nullptr};
 
-void output_context(const char* pathname, const size_t query_offset)
-{
-    const auto compilation_environment = CompilationEnvironments().get_compile_environment(pathname);
-    // Check compiler used?  if (not is_clang(compilation_environment.CommandLine[0])) { XXX }
-    change_directory(compilation_environment.Directory.c_str());
+    const auto output_stats = [&stats]()
+    {
+        if (not stats) { return; }
+        stats->visited_cursor_count = visited_cursor_count;
+        stats->full_walk_fallback_count = full_walk_fallback_count;
+        stats->output(std::cerr);
+    };
 
-    Libclang::TranslationUnitContext translation_unit_context;
-    Libclang::TranslationUnit translation_unit(translation_unit_context, pathname,
-            get_environment_arguments(compilation_environment),
-            /*unsaved_files*/ {},
-            /*options*/ CXTranslationUnit_None);
+    std::unique_ptr<CompilationEnvironments> compilation_environments; // (loaded when first needed)
+    const GetContextsFn get_file_contexts = [&](const char* pathname, const std::vector<size_t>& sorted_query_offsets)
+    {
+        if (approximate)
+        {
+            return get_approximate_contexts(stats.get(), pathname, sorted_query_offsets);
+        }
+        if (not compilation_environments)
+        {
+            compilation_environments = load_compilation_environments(stats.get());
+        }
+        return get_contexts(*compilation_environments, ast_cache.get(), stats.get(), pathname, sorted_query_offsets);
+    };
 
-//    if (clang_getNumDiagnostics(translation_unit)) {}
-    std::cout << get_context(translation_unit, query_offset);
-}
+    if (argc == 1+1 and argv[1] == std::string("--server"))
+    {
+        std::ios::sync_with_stdio(false);
+        return serve(std::cin, std::cout, approximate);
+    }
+
+    if (argc >= 1+1 and argv[1] == std::string("--index"))
+    {
+        size_t thread_count = std::thread::hardware_concurrency();
+        if (argc == 3+1)
+        {
+            std::istringstream iss(argv[2]);
+            if (not (iss.get() == '-' and iss.get() == 'j' and iss >> thread_count and (iss >> std::ws).eof()))
+            {
+                std::cerr << usage_message;
+                return 2;
+            }
+        }
+        else if (argc != 2+1)
+        {
+            std::cerr << usage_message;
+            return 1;
+        }
+        compilation_environments = load_compilation_environments(stats.get());
+        build_scope_index(*compilation_environments, stats.get(), thread_count, /*index_pathname*/ argv[argc-1]);
+        output_stats();
+        return 0;
+    }
 
+    if (argc >= 1+1 and argv[1] == std::string("--annotate"))
+    {
+        if (not (argc == 1+1 or (argc == 2+1 and argv[2] == std::string("--bytes"))))
+        {
+            std::cerr << usage_message;
+            return 1;
+        }
+        std::ios::sync_with_stdio(false);
+        if (not approximate)
+        {
+            compilation_environments.reset(new CompilationEnvironments);
+        }
+        annotate_search_results(compilation_environments.get(), std::cin, std::cout, /*has_byte_offsets*/ argc == 2+1,
+                                /*max_files_in_flight*/ std::thread::hardware_concurrency());
+        return 0;
+    }
 
-int main(int argc, char* argv[])
-{
-    const char* usage_message = "Usage: pathname zero-based_offset\n"; // XXX It currently appears that pathname must be an absolute path - or maybe it just has to match character-for-character an entry in the compile_commands.json file. Should clang::tooling::CompilationDatabase::getCompileCommands() expand relative paths?
+    if (argc >= 1+1 and argv[1] == std::string("--lookup"))
+    {
+        size_t query_offset;
+        std::istringstream iss(argc == 4+1 ? argv[4] : "");
+        if (not (iss >> query_offset))
+        {
+            std::cerr << usage_message;
+            return 2;
+        }
+        std::cout << ScopeIndex(/*index_pathname*/ argv[2]).get_context(/*pathname*/ argv[3], query_offset);
+        return 0;
+    }
+
+    if (argc >= 1+1 and argv[1] == std::string("--batch"))
+    {
+        if (argc == 1+1)
+        {
+            const auto result = output_contexts(get_file_contexts, std::cin);
+            output_stats();
+            return result;
+        }
+        if (argc == 2+1)
+        {
+            std::ifstream query_file(argv[2]);
+            if (not query_file)
+            {
+                std::cerr << "Unable to open " << argv[2] << "\n";
+                return 3;
+            }
+            const auto result = output_contexts(get_file_contexts, query_file);
+            output_stats();
+            return result;
+        }
+        std::cerr << usage_message;
+        return 1;
+    }
 
     if (argc != 2+1)
     {
@@ -144,5 +407,6 @@ int main(int argc, char* argv[])
         }
     }
 
-    output_context(/*pathname*/ argv[1], query_offset);
+    output_context(get_file_contexts, /*pathname*/ argv[1], query_offset);
+    output_stats();
 }
@@ -0,0 +1,60 @@
+// Read-only memory-mapped files.
+
+#pragma once
+
+#include <cerrno>
+#include <cstring> // strerror
+#include <fcntl.h> // open
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h> // close
+
+
+class MappedFile
+{
+    const char* contents{nullptr};
+    size_t length{0};
+  public:
+    explicit MappedFile(const char* pathname)
+    {
+        const int fd = open(pathname, O_RDONLY);
+        if (fd == -1)
+        {
+            throw std::runtime_error(std::string("Unable to open ") + pathname + ". " + strerror(errno));
+        }
+
+        struct stat file_status;
+        if (fstat(fd, &file_status))
+        {
+            close(fd);
+            throw std::runtime_error(std::string("fstat failed for ") + pathname + ". " + strerror(errno));
+        }
+        length = file_status.st_size;
+
+        if (length) // (mmap() fails for zero length.)
+        {
+            void* p = mmap(/*addr*/ NULL, length, PROT_READ, MAP_PRIVATE, fd, /*offset*/ 0);
+            if (p == MAP_FAILED)
+            {
+                close(fd);
+                throw std::runtime_error(std::string("mmap failed for ") + pathname + ". " + strerror(errno));
+            }
+            contents = static_cast<const char*>(p);
+        }
+        close(fd);
+    }
+
+    ~MappedFile()
+    {
+        if (contents)
+            munmap(const_cast<char*>(contents), length);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return contents; }
+    size_t size() const { return length; }
+};
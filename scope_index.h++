@@ -0,0 +1,342 @@
+// An index of the scopes in every file of a project, built by parsing every translation unit in the compilation database.
+// Looking up a context in the index doesn't need libclang (or parsing); it's a binary search of a memory-mapped file.
+
+#pragma once
+
+#include "compilation_environments.h++"
+#include "libclang++.h++"
+#include "mapped_file.h++"
+#include "stats.h++"
+#include "thread_pool.h++"
+#include <algorithm> // equal, lower_bound, sort, upper_bound
+#include <cstdint>
+#include <cstdio> // rename
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+// Index file layout (native byte order):
+//   ScopeIndexHeader
+//   ScopeIndexFile[file_count]     - sorted by pathname (canonical absolute pathnames)
+//   ScopeIndexScope[scope_count]   - each file's scopes are contiguous and sorted by start (outer scopes before inner scopes that start at the same offset)
+//   pathnames and scope names (not null terminated)
+struct ScopeIndexHeader
+{
+    char magic[8];
+    uint32_t file_count;
+    uint32_t scope_count;
+};
+
+struct ScopeIndexFile
+{
+    uint32_t pathname_offset, pathname_length; // (Offsets are from the start of the strings.)
+    uint32_t first_scope, scope_count;
+};
+
+struct ScopeIndexScope
+{
+    uint32_t start_offset, one_beyond_end_offset;
+    uint32_t parent; // index of the innermost enclosing scope, relative to the file's first_scope (or no_parent)
+    uint32_t name_offset, name_length;
+
+    static const uint32_t no_parent = 0xffffffff;
+};
+const uint32_t ScopeIndexScope::no_parent;
+
+const char scope_index_magic[8] = {'C', '+', '+', 'C', 'T', 'X', 'I', '1'};
+
+
+struct IndexedScope
+{
+    uint32_t start_offset, one_beyond_end_offset;
+    uint32_t parent; // (index into the same file's scopes, or ScopeIndexScope::no_parent)
+    std::string name;
+};
+
+using IndexedFiles = std::map<std::string /*canonical pathname*/, std::vector<IndexedScope>>;
+
+
+// Adds the scopes in the files of translation_unit that claim_file() returns true for (claim_file() is called once for each file, with its canonical pathname).
+// directory is the translation unit's working directory: libclang's names for files reached through relative include paths are relative to it.
+void index_translation_unit(/*const*/ Libclang::TranslationUnit& translation_unit, const std::string& directory, const std::function<bool(const std::string& pathname)>& claim_file, IndexedFiles& indexed_files)
+{
+    std::unordered_map<CXFile, std::vector<IndexedScope>* /*null if not claimed*/> file_scopes;
+
+    struct VisitedNode { CXCursor cursor; std::vector<IndexedScope>* scopes; uint32_t scope_index; };
+    std::vector<VisitedNode> ancestors {{translation_unit.get_cursor(), nullptr, ScopeIndexScope::no_parent}};
+
+    Libclang::visit_children(translation_unit.get_cursor(),
+            [&](const CXCursor& cursor, const CXCursor& parent)
+            {
+                while (ancestors.back().cursor != parent) { ancestors.pop_back(); }
+
+                const auto extent = clang_getCursorExtent(cursor);
+                CXFile file, end_file;
+                unsigned start_offset, one_beyond_end_offset;
+                clang_getFileLocation(clang_getRangeStart(extent), &file, /*line*/ NULL, /*column*/ NULL, &start_offset);
+                clang_getFileLocation(clang_getRangeEnd(extent), &end_file, /*line*/ NULL, /*column*/ NULL, &one_beyond_end_offset);
+                if (not file or file != end_file) // XXX AST elements that span files (see the "struct spanning two files" test) aren't indexed.
+                {
+                    return Libclang::NextNode::Sibling;
+                }
+
+                auto it = file_scopes.find(file);
+                if (it == file_scopes.end())
+                {
+                    const auto pathname = canonical_pathname(static_cast<const char*>(Libclang::String{clang_getFileName(file)}), directory);
+                    it = file_scopes.emplace(file, claim_file(pathname) ? &indexed_files[pathname] : nullptr).first;
+                }
+                auto* const scopes = it->second;
+                if (not scopes) // (Another translation unit indexes this file.)
+                {
+                    return Libclang::NextNode::Sibling;
+                }
+
+                auto parent_scope_index = ScopeIndexScope::no_parent;
+                for (auto a = ancestors.rbegin(); a != ancestors.rend(); ++a)
+                {
+                    if (a->scopes == scopes) { parent_scope_index = a->scope_index; break; }
+                }
+
+                auto name = scope_name(cursor);
+                if (name.empty())
+                {
+                    ancestors.push_back({cursor, scopes, parent_scope_index});
+                }
+                else
+                {
+                    name.pop_back(); // (newline)
+                    scopes->push_back({start_offset, one_beyond_end_offset, parent_scope_index, name});
+                    ancestors.push_back({cursor, scopes, uint32_t(scopes->size() - 1)});
+                }
+                return Libclang::NextNode::Child;
+            });
+}
+
+
+void write_scope_index(IndexedFiles& indexed_files, const std::string& index_pathname)
+{
+    std::vector<ScopeIndexFile> files;
+    std::vector<ScopeIndexScope> scopes;
+    std::string strings;
+
+    for (auto& pathname_and_scopes : indexed_files)
+    {
+        auto& file_scopes = pathname_and_scopes.second;
+
+        std::vector<uint32_t> order(file_scopes.size());
+        for (uint32_t i = 0; i != order.size(); ++i) { order[i] = i; }
+        std::sort(order.begin(), order.end(), [&file_scopes](uint32_t a, uint32_t b)
+                {
+                    return file_scopes[a].start_offset != file_scopes[b].start_offset
+                        ? file_scopes[a].start_offset < file_scopes[b].start_offset
+                        : file_scopes[a].one_beyond_end_offset > file_scopes[b].one_beyond_end_offset;
+                });
+        std::vector<uint32_t> new_index(file_scopes.size());
+        for (uint32_t i = 0; i != order.size(); ++i) { new_index[order[i]] = i; }
+
+        files.push_back({uint32_t(strings.size()), uint32_t(pathname_and_scopes.first.size()), uint32_t(scopes.size()), uint32_t(file_scopes.size())});
+        strings += pathname_and_scopes.first;
+
+        for (const auto i : order)
+        {
+            const auto& scope = file_scopes[i];
+            scopes.push_back({scope.start_offset, scope.one_beyond_end_offset,
+                              scope.parent == ScopeIndexScope::no_parent ? ScopeIndexScope::no_parent : new_index[scope.parent],
+                              uint32_t(strings.size()), uint32_t(scope.name.size())});
+            strings += scope.name;
+        }
+    }
+
+    ScopeIndexHeader header;
+    std::copy(scope_index_magic, scope_index_magic + sizeof(header.magic), header.magic);
+    header.file_count = files.size();
+    header.scope_count = scopes.size();
+
+    const auto temporary_pathname = index_pathname + ".tmp";
+    {
+        std::ofstream out(temporary_pathname, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(files.data()), files.size() * sizeof(files[0]));
+        out.write(reinterpret_cast<const char*>(scopes.data()), scopes.size() * sizeof(scopes[0]));
+        out.write(strings.data(), strings.size());
+        if (not out.flush())
+        {
+            throw std::runtime_error("Unable to write " + temporary_pathname);
+        }
+    }
+    if (rename(temporary_pathname.c_str(), index_pathname.c_str()))
+    {
+        throw std::runtime_error("Unable to rename " + temporary_pathname + " to " + index_pathname);
+    }
+}
+
+
+// Parses every translation unit in the compilation database (using thread_count threads) and writes the scopes in all the files they include to index_pathname.
+// Each file is only indexed once, by the first translation unit to include it.
+void build_scope_index(CompilationEnvironments& compilation_environments, Stats* stats /*may be null*/, size_t thread_count, const std::string& index_pathname)
+{
+    std::vector<std::string> source_files;
+    std::vector<CompilationEnv> compilation_environment_for_file;
+    {
+        Stats::Timer timer(stats, "find compile commands");
+        for (const auto& source_file : compilation_environments.get_all_source_files())
+        {
+            try
+            {
+                compilation_environment_for_file.push_back(compilation_environments.get_compile_environment(source_file));
+                source_files.push_back(source_file);
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << source_file << ": " << e.what() << "\n";
+            }
+        }
+    }
+
+    std::mutex mutex; // (for claimed_files, indexed_files and std::cerr)
+    std::set<std::string> claimed_files;
+    IndexedFiles indexed_files;
+    std::vector<std::pair<std::string, std::vector<std::string>>> inclusions; // (main file and the files it includes, for each translation unit; see CompilationEnvironments::record_inclusions())
+    std::vector<std::unique_ptr<Libclang::Index>> libclang_indexes(thread_count ? thread_count : 1); // (one per worker)
+
+    {
+        Stats::Timer timer(stats, "parse and index");
+        run_tasks_in_parallel(source_files.size(), thread_count,
+                [&](size_t task_index, size_t worker_index)
+                {
+                    const auto& compilation_environment = compilation_environment_for_file[task_index];
+                    try
+                    {
+                        if (not libclang_indexes[worker_index])
+                        {
+                            libclang_indexes[worker_index].reset(new Libclang::Index(/*exclude_declarations_from_PCH*/ true, /*display_diagnostics*/ false));
+                        }
+
+                        Libclang::TranslationUnit translation_unit(*libclang_indexes[worker_index], compilation_environment.main_file.c_str(),
+                                get_environment_arguments_with_working_directory(compilation_environment),
+                                /*unsaved_files*/ {},
+                                /*options*/ CXTranslationUnit_None);
+
+                        IndexedFiles translation_unit_files;
+                        index_translation_unit(translation_unit, compilation_environment.directory,
+                                [&](const std::string& pathname)
+                                {
+                                    std::lock_guard<std::mutex> lock(mutex);
+                                    return claimed_files.insert(pathname).second;
+                                },
+                                translation_unit_files);
+                        auto file_names = Libclang::get_file_names(translation_unit);
+                        for (auto& file_name : file_names)
+                        {
+                            file_name = canonical_pathname(file_name, compilation_environment.directory); // (The current directory isn't the compilation environment's directory - it's only passed to libclang, as -working-directory.)
+                        }
+
+                        std::lock_guard<std::mutex> lock(mutex);
+                        inclusions.emplace_back(compilation_environment.main_file, std::move(file_names));
+                        for (auto& pathname_and_scopes : translation_unit_files)
+                        {
+                            indexed_files[pathname_and_scopes.first] = std::move(pathname_and_scopes.second);
+                        }
+                    }
+                    catch (const std::exception& e)
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        std::cerr << source_files[task_index] << ": " << e.what() << "\n";
+                    }
+                });
+    }
+
+    {
+        Stats::Timer timer(stats, "write index");
+        write_scope_index(indexed_files, index_pathname);
+    }
+    {
+        Stats::Timer timer(stats, "record inclusions");
+        compilation_environments.record_inclusions(inclusions);
+    }
+}
+
+
+class ScopeIndex
+{
+    MappedFile index_file;
+    const ScopeIndexHeader* header;
+    const ScopeIndexFile* files;
+    const ScopeIndexScope* scopes;
+    const char* strings;
+    size_t strings_length;
+
+    std::string string(uint32_t offset, uint32_t length) const
+    {
+        if (size_t(offset) + length > strings_length)
+        {
+            throw std::runtime_error("Corrupt scope index.");
+        }
+        return std::string(strings + offset, length);
+    }
+
+  public:
+    explicit ScopeIndex(const char* index_pathname)
+      : index_file{index_pathname}
+    {
+        header = reinterpret_cast<const ScopeIndexHeader*>(index_file.data());
+        if (index_file.size() < sizeof(ScopeIndexHeader)
+            or not std::equal(scope_index_magic, scope_index_magic + sizeof(header->magic), header->magic)
+            or index_file.size() < sizeof(ScopeIndexHeader) + size_t(header->file_count) * sizeof(ScopeIndexFile) + size_t(header->scope_count) * sizeof(ScopeIndexScope))
+        {
+            throw std::runtime_error(std::string(index_pathname) + " is not a scope index.");
+        }
+        files = reinterpret_cast<const ScopeIndexFile*>(header + 1);
+        scopes = reinterpret_cast<const ScopeIndexScope*>(files + header->file_count);
+        strings = reinterpret_cast<const char*>(scopes + header->scope_count);
+        strings_length = index_file.data() + index_file.size() - strings;
+    }
+
+    std::string get_context(const char* pathname, const size_t offset) const
+    {
+        const auto canonical = canonical_pathname(pathname);
+        const auto files_end = files + header->file_count;
+        const auto file = std::lower_bound(files, files_end, canonical,
+                [this](const ScopeIndexFile& f, const std::string& p) { return string(f.pathname_offset, f.pathname_length) < p; });
+        if (file == files_end or string(file->pathname_offset, file->pathname_length) != canonical)
+        {
+            throw std::runtime_error(canonical + " is not in the scope index.");
+        }
+        if (size_t(file->first_scope) + file->scope_count > header->scope_count)
+        {
+            throw std::runtime_error("Corrupt scope index.");
+        }
+
+        // Scopes that contain offset must start at or before offset, and as scopes nest the innermost scope that contains offset must be (or enclose) the last scope that starts at or before offset.
+        const auto file_scopes = scopes + file->first_scope;
+        const auto after = std::upper_bound(file_scopes, file_scopes + file->scope_count, offset,
+                [](size_t o, const ScopeIndexScope& s) { return o < s.start_offset; });
+
+        std::string result;
+        for (auto i = uint32_t(after - file_scopes) - 1 /*(no_parent if there's no such scope)*/;
+             i != ScopeIndexScope::no_parent;
+             i = file_scopes[i].parent)
+        {
+            if (i >= file->scope_count
+                or (file_scopes[i].parent != ScopeIndexScope::no_parent and file_scopes[i].parent >= i))
+            {
+                throw std::runtime_error("Corrupt scope index.");
+            }
+            if (offset < file_scopes[i].one_beyond_end_offset)
+            {
+                result = string(file_scopes[i].name_offset, file_scopes[i].name_length) + "\n" + result;
+            }
+        }
+        return result;
+    }
+};
@@ -0,0 +1,80 @@
+// Time and memory used by each phase of a run (for --stats).
+
+#pragma once
+
+#include <chrono>
+#include <cstdio> // snprintf
+#include <ostream>
+#include <string>
+#include <sys/resource.h> // getrusage
+#include <vector>
+
+
+class Stats
+{
+    struct Phase
+    {
+        std::string name;
+        double wall_milliseconds, cpu_milliseconds;
+        long peak_rss_kibibytes; // (of the process, at the end of the phase)
+    };
+    std::vector<Phase> phases;
+
+    static double cpu_milliseconds() // (user and system time of the process so far)
+    {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e3 + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e3;
+    }
+
+    static long peak_rss_kibibytes()
+    {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss; // (Linux reports kibibytes.)
+    }
+
+  public:
+    size_t visited_cursor_count{0};
+    size_t full_walk_fallback_count{0};
+
+    // Measures the time from construction to destruction as a phase named name. Phases with the same name are reported separately, in the order they ended.
+    class Timer
+    {
+        Stats* stats;
+        std::string name;
+        std::chrono::steady_clock::time_point wall_start;
+        double cpu_start;
+      public:
+        Timer(Stats* stats /*may be null, then nothing is measured*/, const std::string& name)
+          : stats{stats}, name{name}, wall_start{std::chrono::steady_clock::now()}, cpu_start{stats ? cpu_milliseconds() : 0}
+        {
+        }
+
+        ~Timer()
+        {
+            if (not stats) { return; }
+            stats->phases.push_back({name,
+                                     std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - wall_start).count(),
+                                     cpu_milliseconds() - cpu_start,
+                                     peak_rss_kibibytes()});
+        }
+
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+    };
+
+    void output(std::ostream& os) const
+    {
+        char line[128];
+        snprintf(line, sizeof(line), "%-22s %12s %12s %16s\n", "phase", "wall (ms)", "cpu (ms)", "peak RSS (KiB)");
+        os << line;
+        for (const auto& phase : phases)
+        {
+            snprintf(line, sizeof(line), "%-22s %12.3f %12.3f %16ld\n", phase.name.c_str(), phase.wall_milliseconds, phase.cpu_milliseconds, phase.peak_rss_kibibytes);
+            os << line;
+        }
+        os << "cursors visited: " << visited_cursor_count << "\n";
+        os << "full walk fallbacks: " << full_walk_fallback_count << "\n";
+    }
+};
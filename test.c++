@@ -1,23 +1,67 @@
+#include "approximate_context.h++"
+#include "ast_cache.h++"
+#include "compilation_environments.h++"
+#include "grep_annotation.h++"
 #include "libclang++.h++"
+#include "scope_index.h++"
+#include "translation_unit_cache.h++"
+#include <cstdio> // remove
+#include <cstdlib> // mkdtemp
+#include <chrono>
+#include <condition_variable>
 #include <cstring> // strlen
+#include <fstream>
+#include <ftw.h> // nftw
+#include <functional>
 #include <iostream>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <sys/stat.h> // mkdir
+#include <utime.h>
+#include <utility> // make_pair, pair
+#include <vector>
 
 
 unsigned test_failure_count = 0;
 
+// Each test is also run against the approximate lexical scan (of the main file only). It isn't expected to pass them all, so its differences are reported (as a conformance summary) rather than counted as failures.
+unsigned approximate_test_count = 0;
+std::vector<std::string> approximate_differences;
 
-std::string get_context(const char* header_text, const char* source_text, const size_t source_text_offset)
+
+// The translation unit of source_text (as the unsaved file "test_program.c++"), which may include header_text as "/header.h++".
+struct TestTranslationUnit
 {
     Libclang::TranslationUnitContext translation_unit_context;
-    Libclang::TranslationUnit translation_unit(translation_unit_context, "test_program.c++",
-            /*command_line_args*/ {"-std=c++11"},
-            /*unsaved_files*/ {{"test_program.c++", source_text},
-                               {"/header.h++", header_text}},
-            /*options*/ CXTranslationUnit_None);
-
-    return clang_getNumDiagnostics(translation_unit) ? "Libclang generated diagnostic message/s."
-        : get_context(translation_unit, source_text_offset);
+    Libclang::TranslationUnit translation_unit;
+
+    explicit TestTranslationUnit(const std::string& source_text, const std::string& header_text = "")
+      : translation_unit(translation_unit_context, "test_program.c++",
+                /*command_line_args*/ {"-std=c++11"},
+                /*unsaved_files*/ {{"test_program.c++", source_text.c_str(), source_text.length()},
+                                   {"/header.h++", header_text.c_str(), header_text.length()}},
+                /*options*/ CXTranslationUnit_None)
+    {
+    }
+};
+
+
+struct Contexts
+{
+    std::string by_parent_walk, by_full_walk;
+};
+
+Contexts get_contexts(const char* header_text, const char* source_text, const size_t source_text_offset)
+{
+    TestTranslationUnit test_translation_unit(source_text, header_text);
+    auto& translation_unit = test_translation_unit.translation_unit;
+
+    if (clang_getNumDiagnostics(translation_unit))
+    {
+        return {"Libclang generated diagnostic message/s.", "Libclang generated diagnostic message/s."};
+    }
+    return {get_context(translation_unit, source_text_offset), get_context_by_full_walk(translation_unit, source_text_offset)};
 }
 
 
@@ -27,14 +71,25 @@ void test(const char* test_name,
           size_t      source_text_offset,
           const char* expected_output)
 {
-    const auto output = get_context(header_text, source_text, source_text_offset);
-    if (output != expected_output)
+    const auto approximate_context = get_approximate_context(source_text, strlen(source_text), source_text_offset);
+    ++approximate_test_count;
+    if (approximate_context != expected_output)
     {
-        ++test_failure_count;
-        std::cout << test_name << " test failed." << std::endl
-              << "Expected: " << std::endl << expected_output
-              << "Actual Output: " << std::endl << output
-              << std::endl << std::endl;
+        approximate_differences.push_back(std::string(test_name) + "\n    Expected: " + expected_output + "    Approximate: " + approximate_context);
+    }
+
+    const auto contexts = get_contexts(header_text, source_text, source_text_offset);
+    for (const auto& method_and_output : {std::make_pair("get_context()", contexts.by_parent_walk),
+                                          std::make_pair("get_context_by_full_walk()", contexts.by_full_walk)})
+    {
+        if (method_and_output.second != expected_output)
+        {
+            ++test_failure_count;
+            std::cout << test_name << " test failed (" << method_and_output.first << ")." << std::endl
+                  << "Expected: " << std::endl << expected_output
+                  << "Actual Output: " << std::endl << method_and_output.second
+                  << std::endl << std::endl;
+        }
     }
 }
 
@@ -68,6 +123,94 @@ void test(const char* test_name,
 }
 
 
+void check(const std::string& test_name, const std::string& actual_output, const std::string& expected_output)
+{
+    if (actual_output != expected_output)
+    {
+        ++test_failure_count;
+        std::cout << test_name << " test failed." << std::endl
+                  << "Expected: " << std::endl << expected_output
+                  << "Actual Output: " << std::endl << actual_output
+                  << std::endl << std::endl;
+    }
+}
+
+void check(const std::string& test_name, bool passed)
+{
+    if (not passed)
+    {
+        ++test_failure_count;
+        std::cout << test_name << " test failed." << std::endl << std::endl;
+    }
+}
+
+
+// A temporary directory of files, for tests that need files on disk. It's the current directory while the TestProject exists.
+// Its compile_commands.json compiles each source file (with -std=c++11 and compile_options) in the "build" subdirectory.
+class TestProject
+{
+    std::string previous_directory;
+  public:
+    std::string directory;
+
+    using Files = std::vector<std::pair<std::string /*relative pathname*/, std::string /*contents*/>>;
+
+    explicit TestProject(const Files& files)
+      : TestProject(files, /*compile_options*/ "")
+    {
+    }
+
+    TestProject(const Files& files, const char* compile_options)
+      : previous_directory{canonical_pathname(".")}
+    {
+        char directory_template[] = "/tmp/c++_context_test.XXXXXX";
+        if (not mkdtemp(directory_template))
+        {
+            throw std::runtime_error("mkdtemp failed.");
+        }
+        directory = canonical_pathname(directory_template);
+
+        std::string compile_commands;
+        for (const auto& file : files)
+        {
+            write(file.first, file.second);
+            if (has_cpp_source_file_extension(file.first))
+            {
+                compile_commands += std::string(compile_commands.empty() ? "" : ",")
+                                  + "{\"directory\": \"" + pathname("build") + "\", \"command\": \"clang++ -std=c++11 " + std::string(compile_options) + " -c " + pathname(file.first) + "\", \"file\": \"" + pathname(file.first) + "\"}\n";
+            }
+        }
+        write("compile_commands.json", "[\n" + compile_commands + "]\n");
+        mkdir(pathname("build").c_str(), 0777);
+        change_directory(directory.c_str());
+    }
+
+    ~TestProject()
+    {
+        try { change_directory(previous_directory.c_str()); } catch (const std::runtime_error&) { }
+        nftw(directory.c_str(), [](const char* pathname, const struct stat*, int, struct FTW*) { return remove(pathname); }, /*nopenfd*/ 16, FTW_DEPTH | FTW_PHYS);
+    }
+
+    TestProject(const TestProject&) = delete;
+    TestProject& operator=(const TestProject&) = delete;
+
+    std::string pathname(const std::string& relative_pathname) const
+    {
+        return directory + '/' + relative_pathname;
+    }
+
+    void write(const std::string& relative_pathname, const std::string& contents) const // (creating directories as needed)
+    {
+        for (auto i = relative_pathname.find('/'); i != std::string::npos; i = relative_pathname.find('/', i+1))
+        {
+            mkdir(pathname(relative_pathname.substr(0, i)).c_str(), 0777);
+        }
+        std::ofstream file(pathname(relative_pathname), std::ios::binary);
+        file << contents;
+    }
+};
+
+
 void test_global_scope()
 {
     test("Global scope",
@@ -222,6 +365,14 @@ void test_classes()
             "template<typename T> struct S { HERE>T v; };\n",
           "struct S<T>\n");
 
+    test("member function of template struct",
+            "template<typename T> struct S { void doit() { HERE>; } };\n",
+          "struct S<T>\ndoit()\n");
+
+    test("local struct",
+            "void fn() { struct L { void doit() { HERE>; } }; }\n",
+          "fn()\nstruct L\ndoit()\n");
+
     test("template specialization",
             "template<typename T> struct S { int doit() { return 1; } };\n"
             "template<> struct S<bool> { int doit() { return 2; }HERE> };\n",
@@ -302,6 +453,508 @@ void test_miscellaneous()
 }
 
 
+void test_multiple_queries()
+{
+    const char* source_text =
+            "namespace N {\n"
+            "    struct S { void doit() { } };\n"
+            "    void S::doit() { auto f = [](){ return 42; }; }\n"
+            "}\n"
+            "int main() { }\n";
+
+    TestTranslationUnit test_translation_unit(source_text);
+    auto& translation_unit = test_translation_unit.translation_unit;
+
+    const auto offset_of = [source_text](const char* s) { return std::string(source_text).find(s); };
+    const std::vector<size_t> sorted_offsets {
+        offset_of("    struct S"),
+        offset_of("{ } };"),
+        offset_of("{ } };"), // (duplicate offset)
+        offset_of("return 42"),
+        offset_of("}\nint"),
+        offset_of("\nint main"),
+        offset_of("{ }\n")};
+    const std::vector<std::string> expected_contexts {
+        "namespace N\n",
+        "namespace N\nstruct S\ndoit()\n",
+        "namespace N\nstruct S\ndoit()\n",
+        "namespace N\nS::doit()\n[]\n",
+        "namespace N\n",
+        "",
+        "main()\n"};
+
+    const auto contexts = get_contexts(translation_unit, sorted_offsets);
+    for (size_t i = 0; i != sorted_offsets.size(); ++i)
+    {
+        const auto test_name = "multiple queries - query " + std::to_string(i);
+        check(test_name, contexts[i], expected_contexts[i]);
+        check(test_name + " (single query)", get_context(translation_unit, sorted_offsets[i]), expected_contexts[i]);
+    }
+}
+
+
+// get_context() should find nested contexts by walking up from the query position, visiting fewer cursors than get_context_by_full_walk() (which visits everything before the query position).
+void test_parent_walk()
+{
+    std::string source_text;
+    for (int i = 0; i != 50; ++i)
+    {
+        source_text += "int f" + std::to_string(i) + "(int i) { return i + " + std::to_string(i) + "; }\n";
+    }
+    source_text += "namespace N {\n"
+                   "    template<typename T> struct S { T g() { auto l = [](){ return T(); }; return l(); } };\n"
+                   "    struct R { void h(); };\n"
+                   "    void R::h() { int x = 0; (void)x; }\n"
+                   "}\n";
+
+    TestTranslationUnit test_translation_unit(source_text);
+    auto& translation_unit = test_translation_unit.translation_unit;
+
+    for (const auto& query_and_expected_context : {std::make_pair("return T()", "namespace N\nstruct S<T>\ng()\n[]\n"),
+                                                   std::make_pair("return l()", "namespace N\nstruct S<T>\ng()\n"),
+                                                   std::make_pair("int x", "namespace N\nR::h()\n")})
+    {
+        const auto offset = source_text.find(query_and_expected_context.first);
+        const auto test_name = std::string("parent walk - ") + query_and_expected_context.first;
+
+        const auto initial_fallback_count = full_walk_fallback_count;
+        const auto initial_visited_cursor_count = visited_cursor_count;
+        check(test_name, get_context(translation_unit, offset), query_and_expected_context.second);
+        const auto parent_walk_visited_cursor_count = visited_cursor_count - initial_visited_cursor_count;
+        check(test_name + " - without falling back to the full walk", full_walk_fallback_count == initial_fallback_count);
+
+        const auto full_walk_initial_visited_cursor_count = visited_cursor_count;
+        get_context_by_full_walk(translation_unit, offset);
+        check(test_name + " - fewer cursors visited than by the full walk",
+              parent_walk_visited_cursor_count < visited_cursor_count - full_walk_initial_visited_cursor_count);
+    }
+}
+
+
+void test_query_of_header_file()
+{
+    const char* header_text =
+            "namespace H {\n"
+            "    struct T { int f() { return 1; } };\n"
+            "}\n";
+
+    TestTranslationUnit test_translation_unit("#include \"/header.h++\"\nnamespace N { int g() { return 2; } }\n", header_text);
+    auto& translation_unit = test_translation_unit.translation_unit;
+
+    const size_t offset = std::string(header_text).find("return 1");
+    const auto header_file = Libclang::get_file(translation_unit, "/header.h++");
+    const std::string expected_context = "namespace H\nstruct T\nf()\n";
+    check("query of header file", get_context(translation_unit, offset, header_file), expected_context);
+    check("query of header file (multiple queries)", get_contexts(translation_unit, {offset, offset} /*(two, so that get_contexts() doesn't hand the query to get_context())*/, header_file)[0], expected_context);
+}
+
+
+std::string describe(const SearchResultLine& line)
+{
+    return std::string(line.is_match ? "match" : "not a match")
+           + ", pathname: " + line.pathname
+           + ", line number: " + std::to_string(line.line_number)
+           + ", line offset: " + (line.line_offset == SearchResultLine::unknown_offset ? "unknown" : std::to_string(line.line_offset))
+           + ", text: " + line.text + "\n";
+}
+
+// Parsing of the search results read by --annotate.
+void test_search_result_parsing()
+{
+    const auto unknown = SearchResultLine::unknown_offset;
+
+    std::string s;
+    check("JSON string", std::to_string(parse_json_string("x \"abc\" y", 2, s)) + s, "1abc");
+    s.clear();
+    check("JSON string - escapes", std::to_string(parse_json_string(R"("a\"b\\c\/d\n\t\r\b\f")", 0, s)) + s, "1a\"b\\c/d\n\t\r\b\f");
+    s.clear();
+    check("JSON string - \\u escapes", std::to_string(parse_json_string(R"("\u0041\u00e9\u20ac\ud83d\ude00")", 0, s)) + s, "1A\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80");
+    s.clear();
+    check("JSON string - unterminated", not parse_json_string(R"("abc\")", 0, s));
+    s.clear();
+    check("JSON string - not a string", not parse_json_string("abc", 0, s) and not parse_json_string("\"abc\"", 5, s));
+
+    check("grep -n line",
+          describe(parse_grep_line("src/a.c++:12:    x = 1; // a-5-b", /*has_byte_offsets*/ false)),
+          describe({"src/a.c++:12:    x = 1; // a-5-b", true, "src/a.c++", 12, unknown}));
+    check("grep -b line",
+          describe(parse_grep_line("src/a.c++:1234:    x = 1;", /*has_byte_offsets*/ true)),
+          describe({"src/a.c++:1234:    x = 1;", true, "src/a.c++", 0, 1234}));
+    check("grep line - pathname containing ':' and '-'",
+          describe(parse_grep_line("dir:x/a-b:c.c++:3:f(a:1);", /*has_byte_offsets*/ false)),
+          describe({"dir:x/a-b:c.c++:3:f(a:1);", true, "dir:x/a-b:c.c++", 3, unknown}));
+    check("grep -C context line containing \":digits:\"",
+          describe(parse_grep_line("src/a.c++-11-    std::cout << \"at :123: here\";", /*has_byte_offsets*/ false)),
+          describe({"src/a.c++-11-    std::cout << \"at :123: here\";", false, "", 0, unknown}));
+    check("grep -C separator",
+          describe(parse_grep_line("--", /*has_byte_offsets*/ false)),
+          describe({"--", false, "", 0, unknown}));
+
+    check("rg --json match",
+          describe(parse_ripgrep_json_line(R"({"type":"match","data":{"path":{"text":"src/a \"b\".c++"},"lines":{"text":"    x = \"1:2:\";\n"},"line_number":42,"absolute_offset":1234,"submatches":[{"match":{"text":"x"},"start":4,"end":5}]}})")),
+          describe({"src/a \"b\".c++:42:    x = \"1:2:\";", true, "src/a \"b\".c++", 42, 1234}));
+    for (const auto& type_and_line : {std::make_pair("begin", R"({"type":"begin","data":{"path":{"text":"src/a.c++"}}})"),
+                                      std::make_pair("context", R"({"type":"context","data":{"path":{"text":"src/a.c++"},"lines":{"text":"    \"type\":\"match\"\n"},"line_number":41,"absolute_offset":1200,"submatches":[]}})"),
+                                      std::make_pair("end", R"({"type":"end","data":{"path":{"text":"src/a.c++"},"binary_offset":null,"stats":{"elapsed":{"secs":0,"nanos":1,"human":"0s"},"searches":1,"searches_with_match":1,"bytes_searched":2,"bytes_printed":3,"matched_lines":1,"matches":1}}})")})
+    {
+        check(std::string("rg --json ") + type_and_line.first + " message",
+              describe(parse_ripgrep_json_line(type_and_line.second)),
+              describe({"", false, "", 0, unknown}));
+    }
+}
+
+
+// The scope index (written by --index and read by --lookup) should give the same contexts as get_context().
+// An output stream buffer that one thread writes to while another waits for text to appear in it.
+class SharedOutput : public std::streambuf
+{
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::string text;
+
+  protected:
+    int overflow(int c) override
+    {
+        if (c != traits_type::eof())
+        {
+            const char ch = traits_type::to_char_type(c);
+            xsputn(&ch, 1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            text.append(s, n);
+        }
+        changed.notify_all();
+        return n;
+    }
+
+  public:
+    bool wait_for(const std::string& s) // (Gives up after 10 seconds.)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        return changed.wait_for(lock, std::chrono::seconds(10), [&]() { return text.find(s) != std::string::npos; });
+    }
+
+    std::string contents()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return text;
+    }
+};
+
+// An input stream buffer that provides parts of its input one at a time, calling pause() before each part after the first (as grep pauses while it searches).
+class PausingInput : public std::streambuf
+{
+    std::vector<std::string> parts;
+    size_t next_part_index{0};
+    std::function<void()> pause;
+
+  protected:
+    int underflow() override
+    {
+        if (next_part_index == parts.size()) { return traits_type::eof(); }
+        if (next_part_index != 0) { pause(); }
+        auto& part = parts[next_part_index++];
+        setg(&part[0], &part[0], &part[0] + part.size());
+        return traits_type::to_int_type(part[0]);
+    }
+
+  public:
+    PausingInput(const std::vector<std::string>& parts, const std::function<void()>& pause)
+      : parts{parts}, pause{pause}
+    {
+    }
+};
+
+// --annotate should write each file's annotated lines as soon as they're ready, rather than waiting for more input.
+void test_annotation_streaming()
+{
+    TestProject project({{"a.c++", "void f() {\n    int x;\n}\n"}, {"b.c++", "void g() {\n    int y;\n}\n"}});
+    SharedOutput shared_output;
+    std::ostream output(&shared_output);
+    PausingInput paused_input({"a.c++:2:    int x;\nb.c++:1:void g() {\n", /*(a.c++ is complete once b.c++'s results start)*/
+                               "b.c++:2:    int y;\n"},
+                              /*pause*/ [&shared_output]() { check("annotation streaming - file written while input is idle", shared_output.wait_for("a.c++:2:")); });
+    std::istream input(&paused_input);
+
+    annotate_search_results(/*compilation_environments*/ nullptr, input, output, /*has_byte_offsets*/ false, /*max_files_in_flight*/ 4);
+    check("annotation streaming - output", shared_output.contents(),
+          "[f() / (approximate)] a.c++:2:    int x;\n"
+          "[g() / (approximate)] b.c++:1:void g() {\n"
+          "[g() / (approximate)] b.c++:2:    int y;\n");
+}
+
+
+void test_scope_index()
+{
+    const std::string header_text =
+            "namespace H {\n"
+            "    struct T { int f() { return 1; } };\n"
+            "}\n";
+    const std::string source_text =
+            "#include \"/header.h++\"\n"
+            "namespace N {\n"
+            "    struct S { void a() { } };\n"
+            "    void b() { auto l = [](){ return 2; }; }\n"
+            "}\n"
+            "int main() { }\n";
+
+    TestProject project({}); // (for the index file, and so that "test_program.c++" isn't the name of a file in the current directory)
+    TestTranslationUnit test_translation_unit(source_text, header_text);
+    auto& translation_unit = test_translation_unit.translation_unit;
+
+    IndexedFiles indexed_files;
+    index_translation_unit(translation_unit, project.directory, /*claim_file*/ [](const std::string&) { return true; }, indexed_files);
+    const auto index_pathname = project.pathname("scopes.index");
+    write_scope_index(indexed_files, index_pathname);
+    const ScopeIndex scope_index(index_pathname.c_str());
+
+    struct Query { const char* test_name; const char* pathname; size_t offset; const char* expected_context; };
+    for (const auto& query : {Query{"nested scopes", "test_program.c++", source_text.find("{ } };"), "namespace N\nstruct S\na()\n"},
+                              Query{"after a sibling's end", "test_program.c++", source_text.find("    void b"), "namespace N\n"},
+                              Query{"lambda", "test_program.c++", source_text.find("return 2"), "namespace N\nb()\n[]\n"},
+                              Query{"global scope", "test_program.c++", source_text.find("\nint main"), ""},
+                              Query{"header file", "/header.h++", header_text.find("return 1"), "namespace H\nstruct T\nf()\n"}})
+    {
+        const auto file = Libclang::get_file(translation_unit, query.pathname);
+        const auto test_name = std::string("scope index - ") + query.test_name;
+        check(test_name + " (get_context())", get_context(translation_unit, query.offset, file), query.expected_context);
+        check(test_name, scope_index.get_context((query.pathname[0] == '/' ? query.pathname : project.pathname(query.pathname)).c_str(), query.offset), query.expected_context);
+    }
+}
+
+
+// build_scope_index() indexes each file once (although several translation units include it), keyed by canonical pathname - even if it's included through a relative include path (which libclang reports relative to the compile directory, not the current directory).
+void test_build_scope_index()
+{
+    const std::string header_text = "namespace H {\n    struct T { int f() { return 1; } };\n}\n";
+    const std::string a_text = "#include \"h.h++\"\nnamespace A { int a() { return H::T().f(); } }\n";
+    const std::string b_text = "#include \"h.h++\"\nnamespace B { int b() { return H::T().f(); } }\n";
+    TestProject project({{"src/a.c++", a_text}, {"src/b.c++", b_text}, {"include/h.h++", header_text}}, /*compile_options*/ "-I../include");
+    const auto a = project.pathname("src/a.c++"), b = project.pathname("src/b.c++"), h = project.pathname("include/h.h++");
+
+    CompilationEnvironments compilation_environments;
+    const auto index_pathname = project.pathname("scopes.index");
+    build_scope_index(compilation_environments, /*stats*/ nullptr, /*thread_count*/ 2, index_pathname);
+    const ScopeIndex scope_index(index_pathname.c_str());
+
+    check("build scope index - source file", scope_index.get_context(a.c_str(), a_text.find("return")), "namespace A\na()\n");
+    check("build scope index - another source file", scope_index.get_context(b.c_str(), b_text.find("return")), "namespace B\nb()\n");
+    check("build scope index - header file included through a relative include path", scope_index.get_context(h.c_str(), header_text.find("return 1")), "namespace H\nstruct T\nf()\n");
+    const auto header_main_file = compilation_environments.get_compile_environment(h).main_file;
+    check("build scope index - header file's inclusion recorded", header_main_file == a or header_main_file == b);
+}
+
+
+void test_translation_unit_cache()
+{
+    const std::string a_text = "namespace A { void f() { } }\n";
+    TestProject project({{"a.c++", a_text}, {"b.c++", "void b() { }\n"}, {"c.c++", "void c() { }\n"}});
+    CompilationEnvironments compilation_environments;
+    TranslationUnitCache translation_units(/*capacity*/ 2, compilation_environments);
+
+    const auto a = project.pathname("a.c++"), b = project.pathname("b.c++"), c = project.pathname("c.c++");
+    const auto a_environment = compilation_environments.get_compile_environment(a);
+    const auto b_environment = compilation_environments.get_compile_environment(b);
+    const auto c_environment = compilation_environments.get_compile_environment(c);
+    const auto offset = a_text.find("{ }");
+
+    check("translation unit cache - file on disk",
+          get_context(translation_units.get(a_environment, a.c_str(), /*unsaved_contents*/ nullptr), offset), "namespace A\nf()\n");
+    const std::string edited_text = "namespace B { void g() { } }\n";
+    check("translation unit cache - unsaved contents",
+          get_context(translation_units.get(a_environment, a.c_str(), &edited_text), offset), "namespace B\ng()\n");
+    const std::string edited_again_text = "struct C { void h() { } };\n";
+    check("translation unit cache - changed unsaved contents",
+          get_context(translation_units.get(a_environment, a.c_str(), &edited_again_text), offset), "struct C\nh()\n");
+    check("translation unit cache - unsaved contents discarded",
+          get_context(translation_units.get(a_environment, a.c_str(), /*unsaved_contents*/ nullptr), offset), "namespace A\nf()\n");
+
+    translation_units.get(b_environment, b.c_str(), /*unsaved_contents*/ nullptr);
+    translation_units.get(a_environment, a.c_str(), /*unsaved_contents*/ nullptr); // (a is now the most recently used, b the least.)
+    translation_units.get(c_environment, c.c_str(), /*unsaved_contents*/ nullptr);
+    check("translation unit cache - least recently used is discarded at capacity",
+          translation_units.contains(a_environment) and not translation_units.contains(b_environment) and translation_units.contains(c_environment));
+}
+
+
+void test_relative_pathname_query()
+{
+    const std::string header_text = "namespace H {\n    struct T { int f() { return 1; } };\n}\n";
+    TestProject project({{"a.c++", "#include \"include/../include/h.h++\"\nint main() { return H::T().f(); }\n"}, {"include/h.h++", header_text}}); // (The header file is queried by its canonical pathname, which isn't how it's spelt by the #include.)
+    const auto working_directory = canonical_pathname(".");
+    CompilationEnvironments compilation_environments;
+    TranslationUnitCache translation_units(/*capacity*/ 2, compilation_environments);
+
+    // (As in --server: pathnames are relative to the directory c++_context started in, but each query changes the current directory.)
+    translation_units.get_context(canonical_pathname("a.c++", working_directory), /*offset*/ 0, /*unsaved_contents*/ nullptr); // (records that a.c++ includes the header file)
+    check("relative pathname query - current directory changed", canonical_pathname(".") == project.pathname("build"));
+    check("relative pathname query of header file",
+          translation_units.get_context(canonical_pathname("include/h.h++", working_directory), header_text.find("return 1"), /*unsaved_contents*/ nullptr),
+          "namespace H\nstruct T\nf()\n");
+}
+
+
+bool has_compile_environment(CompilationEnvironments& compilation_environments, const std::string& pathname)
+{
+    try
+    {
+        compilation_environments.get_compile_environment(pathname);
+        return true;
+    }
+    catch (const std::runtime_error&)
+    {
+        return false;
+    }
+}
+
+void test_corrupt_compilation_database_index()
+{
+    TestProject project({{"a.c++", "#include \"h.h++\"\n"}, {"h.h++", "\n"}});
+    const auto a = project.pathname("a.c++"), h = project.pathname("h.h++");
+    CompilationEnvironments(/*writes the index*/).record_inclusions(a, {a, h});
+
+    // Overwrite the first entry's first offset (of its pathname, or of its header file's pathname) in each file. (compile_commands.json is unchanged, so the index still appears to be up to date.)
+    const auto corrupt = [&project](const std::string& relative_pathname, size_t entry_position)
+    {
+        std::fstream file(project.pathname(relative_pathname), std::ios::in | std::ios::out | std::ios::binary);
+        const uint32_t offset = 0xffffffff;
+        file.seekp(entry_position);
+        file.write(reinterpret_cast<const char*>(&offset), sizeof(offset));
+    };
+    corrupt("compile_commands.json.c++_context", sizeof(CompilationDatabaseIndexHeader));
+    corrupt("compile_commands.json.c++_context-headers", sizeof(HeaderMapHeader));
+
+    CompilationEnvironments compilation_environments;
+    check("corrupt compilation database index is rebuilt",
+          has_compile_environment(compilation_environments, a) and compilation_environments.get_compile_environment(a).directory == project.pathname("build"));
+    check("corrupt header map is ignored", not has_compile_environment(compilation_environments, h));
+    compilation_environments.record_inclusions(a, {a, h});
+    check("corrupt header map is rewritten",
+          has_compile_environment(compilation_environments, h) and compilation_environments.get_compile_environment(h).main_file == a);
+}
+
+
+void test_ast_cache()
+{
+    const std::string source_text = "#include \"header.h++\"\nnamespace N { void f() { } }\n";
+    TestProject project({{"a.c++", source_text}, {"header.h++", "struct H { };\n"}});
+    CompilationEnvironments compilation_environments;
+    const auto compilation_environment = compilation_environments.get_compile_environment(project.pathname("a.c++"));
+    const AstCache ast_cache(project.pathname("cache"));
+    change_directory(compilation_environment.directory);
+
+    Libclang::TranslationUnitContext translation_unit_context;
+    check("AST cache - nothing saved", not ast_cache.load(translation_unit_context, compilation_environment));
+    {
+        Libclang::TranslationUnit translation_unit(translation_unit_context, compilation_environment.main_file.c_str(),
+                get_environment_arguments(compilation_environment),
+                /*unsaved_files*/ {},
+                /*options*/ CXTranslationUnit_ForSerialization);
+        ast_cache.save(translation_unit, compilation_environment);
+    }
+
+    const auto loaded_translation_unit = ast_cache.load(translation_unit_context, compilation_environment);
+    check("AST cache - load of saved translation unit", bool(loaded_translation_unit));
+    if (loaded_translation_unit)
+    {
+        check("AST cache - context in loaded translation unit",
+              get_context(*loaded_translation_unit, source_text.find("{ }")), "namespace N\nf()\n");
+    }
+
+    const auto header = project.pathname("header.h++");
+    struct stat header_status;
+    stat(header.c_str(), &header_status);
+    const struct utimbuf times{header_status.st_atime, header_status.st_mtime + 10};
+    utime(header.c_str(), &times);
+    check("AST cache - included file modified", not ast_cache.load(translation_unit_context, compilation_environment));
+}
+
+
+void test_approximate(const char* test_name, const char* source_text_with_HERE_denoting_query_position, const char* expected_output)
+{
+    std::string source_text(source_text_with_HERE_denoting_query_position);
+    const auto source_text_offset = source_text.find("HERE>");
+    if (source_text_offset == std::string::npos)
+    {
+        ++test_failure_count;
+        std::cout << test_name << " test is broken." << std::endl << std::endl;
+        return;
+    }
+    source_text.replace(source_text_offset, strlen("HERE>"), "");
+
+    check(std::string(test_name) + " (get_approximate_context())", get_approximate_context(source_text.data(), source_text.length(), source_text_offset), expected_output);
+}
+
+// Tests of the approximate lexical scan alone: braces that it must not count.
+void test_approximate_scan()
+{
+    test_approximate("approximate - braces in comments",
+            "void f() { /* { */ // {\n HERE> }\n",
+         "f()\n");
+
+    test_approximate("approximate - braces in string and character literals",
+            "void f() { const char* s = \"{\\\"{\"; char c = '{'; char d = '\\''; HERE> }\n",
+         "f()\n");
+
+    test_approximate("approximate - raw string literal",
+            "void f() { auto s = R\"x(}\")x\"; auto t = u8R\"({)\"; HERE> }\n",
+         "f()\n");
+
+    test_approximate("approximate - digit separators",
+            "void f() { int n = 1'000'000; HERE> }\n",
+         "f()\n");
+
+    test_approximate("approximate - preprocessor lines",
+            "#define BEGIN {\n"
+            "#define END \\\n"
+            "    }\n"
+            "namespace N { void f() { HERE> } }\n",
+         "namespace N\nf()\n");
+
+    test_approximate("approximate - lambda argument",
+            "void f() { std::sort(a, b, [&](const T& x, const T& y) -> bool { HERE>return x < y; }); }\n",
+         "f()\n[]\n");
+
+    test_approximate("approximate - braced member initializer",
+            "struct S { S() : v{1, 2}, i(3) { HERE> } std::vector<int> v; int i; };\n",
+         "struct S\nS()\n");
+
+    test_approximate("approximate - braced default argument",
+            "class C { int g(std::map<int,int> m = {}) noexcept { HERE> } };\n",
+         "class C\ng(std::map<int, int>)\n");
+
+    test_approximate("approximate - braced default argument with elements",
+            "void f(std::vector<int> v = {1,2}) { HERE> }\n",
+         "f(std::vector<int>)\n");
+
+    test_approximate("approximate - lambda default argument",
+            "void f(std::function<int()> g = [] { return 1; }) { HERE> }\n",
+         "f(std::function<int ()>)\n");
+
+    test_approximate("approximate - braced default arguments",
+            "void f(std::vector<int> v = {1}, std::vector<int> w = {2}) { HERE> }\n",
+         "f(std::vector<int>, std::vector<int>)\n");
+
+    test_approximate("approximate - parentheses in literals, comments and for statements",
+            "void f() { g(\")\"); h(')'); /* ( */ for (int i = 0; i < n; ++i) { } k([] { HERE> }); }\n",
+         "f()\n[]\n");
+
+    test_approximate("approximate - nested namespace definition",
+            "namespace A::B { void f(int (*fp)(int), char* argv[]) { HERE> } }\n",
+         "namespace A\nnamespace B\nf(int (*)(int), char **)\n");
+
+    test_approximate("approximate - operators",
+            "struct S { bool operator==(const S& o) const { HERE>return true; } };\n",
+         "struct S\noperator==(const S &)\n");
+}
+
+
 int main()
 {
     test_global_scope();
@@ -310,6 +963,24 @@ int main()
     test_classes();
     test_enums();
     test_miscellaneous();
+    test_multiple_queries();
+    test_parent_walk();
+    test_query_of_header_file();
+    test_search_result_parsing();
+    test_annotation_streaming();
+    test_scope_index();
+    test_build_scope_index();
+    test_translation_unit_cache();
+    test_relative_pathname_query();
+    test_corrupt_compilation_database_index();
+    test_ast_cache();
+    test_approximate_scan();
+
+    std::cout << "get_approximate_context() differs from the expected output for " << approximate_differences.size() << " of " << approximate_test_count << " tests:" << std::endl;
+    for (const auto& difference : approximate_differences)
+    {
+        std::cout << "  " << difference << std::endl;
+    }
 
     if (test_failure_count == 0)
     {
@@ -0,0 +1,72 @@
+// Running independent tasks on several threads.
+
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Calls run_task(task_index, worker_index) for each task_index in [0, task_count), using thread_count threads.
+// Each worker takes tasks from its own queue; a worker whose queue is empty takes ("steals") a task from the back of another worker's queue, so that workers given slow tasks don't hold everything up.
+// worker_index (in [0, thread_count)) can be used to give each worker its own resources. run_task must not throw.
+void run_tasks_in_parallel(size_t task_count, size_t thread_count, const std::function<void(size_t task_index, size_t worker_index)>& run_task)
+{
+    if (thread_count == 0) { thread_count = 1; }
+
+    struct TaskQueue
+    {
+        std::mutex mutex;
+        std::deque<size_t> task_indexes;
+    };
+    std::vector<TaskQueue> task_queues(thread_count);
+    for (size_t i = 0; i != task_count; ++i)
+    {
+        task_queues[i % thread_count].task_indexes.push_back(i);
+    }
+
+    const auto take_task = [&task_queues, thread_count](size_t worker_index, size_t& task_index)
+    {
+        for (size_t n = 0; n != thread_count; ++n)
+        {
+            auto& queue = task_queues[(worker_index + n) % thread_count];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (not queue.task_indexes.empty())
+            {
+                if (n == 0) // (Own queue.)
+                {
+                    task_index = queue.task_indexes.front();
+                    queue.task_indexes.pop_front();
+                }
+                else
+                {
+                    task_index = queue.task_indexes.back();
+                    queue.task_indexes.pop_back();
+                }
+                return true;
+            }
+        }
+        return false;
+    };
+
+    const auto work = [&take_task, &run_task](size_t worker_index)
+    {
+        for (size_t task_index; take_task(worker_index, task_index); )
+        {
+            run_task(task_index, worker_index);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t worker_index = 1; worker_index != thread_count; ++worker_index)
+    {
+        threads.emplace_back(work, worker_index);
+    }
+    work(/*worker_index*/ 0);
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+}
@@ -0,0 +1,132 @@
+// A cache of parsed translation units, for answering many queries without reparsing unchanged files.
+
+#pragma once
+
+#include "compilation_environments.h++"
+#include "libclang++.h++"
+#include <list>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+
+bool are_files_unchanged_since_parse(CXTranslationUnit translation_unit, const char* unsaved_pathname /*file not to check - may be null*/)
+{
+    const CXFile unsaved_file = unsaved_pathname ? clang_getFile(translation_unit, unsaved_pathname) : nullptr;
+    bool unchanged = true;
+    Libclang::visit_inclusions(translation_unit,
+            [&unchanged, unsaved_file](CXFile file)
+            {
+                struct stat file_status;
+                if (unchanged
+                    and not (unsaved_file and file == unsaved_file)
+                    and (stat(Libclang::String{clang_getFileName(file)}, &file_status)
+                         or file_status.st_mtime != clang_getFileTime(file)))
+                {
+                    unchanged = false;
+                }
+            });
+    return unchanged;
+}
+
+
+class TranslationUnitCache // Least recently used translation units are discarded first.
+{
+    struct Entry
+    {
+        std::string key;
+        std::string unsaved_pathname; // (empty if there are no unsaved contents)
+        std::string unsaved_contents;
+        std::unique_ptr<Libclang::TranslationUnit> translation_unit;
+    };
+
+    Libclang::TranslationUnitContext translation_unit_context{/*exclude_declarations_from_PCH*/ true, /*display_diagnostics*/ false}; // (Diagnostics of the files being edited would swamp the server's stderr, which is for its own errors.)
+    std::list<Entry> entries; // (Most recently used first.)
+    const size_t capacity;
+    CompilationEnvironments& compilation_environments; // (The inclusions of each translation unit parsed are recorded.)
+
+  public:
+    TranslationUnitCache(size_t capacity, CompilationEnvironments& compilation_environments)
+      : capacity{capacity}, compilation_environments(compilation_environments)
+    {
+    }
+
+    TranslationUnitCache(const TranslationUnitCache&) = delete;
+    TranslationUnitCache& operator=(const TranslationUnitCache&) = delete;
+
+    bool contains(const CompilationEnv& compilation_environment) const // (Doesn't make the translation unit the most recently used.)
+    {
+        const auto k = translation_unit_key(compilation_environment);
+        for (const auto& entry : entries)
+        {
+            if (entry.key == k) { return true; }
+        }
+        return false;
+    }
+
+    // Returns an up-to-date translation unit for compilation_environment. unsaved_contents (if not null) are used instead of the contents of pathname (the main file or a file it includes) on disk.
+    // Note: changes the current directory to the compilation environment's directory.
+    Libclang::TranslationUnit& get(const CompilationEnv& compilation_environment, const char* pathname, const std::string* unsaved_contents)
+    {
+        const auto k = translation_unit_key(compilation_environment);
+        const std::string unsaved_pathname = unsaved_contents ? pathname : "";
+        std::vector<Libclang::UnsavedFile> unsaved_files;
+        if (unsaved_contents)
+        {
+            unsaved_files.push_back({pathname, unsaved_contents->data(), unsaved_contents->size()});
+        }
+
+        change_directory(compilation_environment.directory);
+
+        for (auto it = entries.begin(); it != entries.end(); ++it)
+        {
+            if (it->key != k) { continue; }
+
+            entries.splice(entries.begin(), entries, it);
+            Entry& entry = entries.front();
+
+            if (entry.unsaved_pathname != unsaved_pathname
+                or (unsaved_contents and entry.unsaved_contents != *unsaved_contents)
+                or not are_files_unchanged_since_parse(*entry.translation_unit, unsaved_contents ? pathname : nullptr))
+            {
+                try
+                {
+                    entry.translation_unit->reparse(unsaved_files);
+                }
+                catch (...)
+                {
+                    entries.pop_front();
+                    throw;
+                }
+                entry.unsaved_pathname = unsaved_pathname;
+                entry.unsaved_contents = unsaved_contents ? *unsaved_contents : "";
+            }
+            return *entry.translation_unit;
+        }
+
+        std::unique_ptr<Libclang::TranslationUnit> translation_unit{new Libclang::TranslationUnit(
+                translation_unit_context, compilation_environment.main_file.c_str(),
+                get_environment_arguments(compilation_environment),
+                unsaved_files,
+                /*options*/ clang_defaultEditingTranslationUnitOptions() /*(includes CXTranslationUnit_PrecompiledPreamble, so reparsing only reparses the main file)*/)};
+
+        compilation_environments.record_inclusions(compilation_environment.main_file, Libclang::get_file_names(*translation_unit));
+
+        entries.push_front({k, unsaved_pathname, unsaved_contents ? *unsaved_contents : "", std::move(translation_unit)});
+        if (entries.size() > capacity)
+        {
+            entries.pop_back();
+        }
+        return *entries.front().translation_unit;
+    }
+
+    // Returns the context of offset in the file at pathname (a source file or a header file), which must be canonical (see canonical_pathname()). unsaved_contents are as for get().
+    // Note: changes the current directory to the compilation environment's directory.
+    std::string get_context(const std::string& pathname, size_t offset, const std::string* unsaved_contents)
+    {
+        const auto compilation_environment = compilation_environments.get_compile_environment(pathname);
+        auto& translation_unit = get(compilation_environment, pathname.c_str(), unsaved_contents);
+        return ::get_context(translation_unit, offset, get_query_file(translation_unit, compilation_environment, pathname));
+    }
+};